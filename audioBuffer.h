@@ -4,6 +4,23 @@
 /* needed defs:
  *   BLOCK_SIZE
  *   BUFFER_BLOCKS
+ *   BUFFER_PAGE_BLOCKS
+ *   BUFFER_POOL_PAGES
+ *   BUFFER_POOL_MAX_CHUNKS
+ *   BUFFER_SLACK_PERIOD
+ *   BUFFER_JITTER_BINS
+ *   BUFFER_JITTER_MULTIPLIER
+ *   BUFFER_LATE_TARGET
+ *   BUFFER_PLC_BLOCKS
+ *   BUFFER_PLC_HISTORY_BLOCKS
+ *   BUFFER_PLC_MIN_PERIOD
+ *   BUFFER_PLC_MAX_PERIOD
+ *   BUFFER_SKIP_PERIOD
+ *   BUFFER_TSM_MAX_BLOCKS
+ *   BUFFER_TSM_MAX_LAG
+ *   BUFFER_TSM_RATE
+ *   MONO_BLOCK_SIZE
+ *   FEC_LOSS_MULTIPLIER
  *   bindex_t
  *   sample_t
  */
@@ -14,70 +31,606 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#ifdef __WIN32__
+#include <malloc.h>
+#endif
 
 #ifndef BLOCK_SIZE
 #define BLOCK_SIZE MONO_BLOCK_SIZE
 #endif
 
+// --- pool of pages shared by all buffers ---
+
+// sound data of BUFFER_PAGE_BLOCKS consecutive blocks
+struct bufferPage {
+	bindex_t base;   // position of the first block
+	uint32_t index;  // within the pool
+	sample_t data[BUFFER_PAGE_BLOCKS * BLOCK_SIZE] __attribute__((aligned(64)));
+};
+
+// lock-free stack of free pages, grown by chunks of BUFFER_POOL_PAGES under mutex;
+// pages are never freed, so they can be accessed even after being returned to the pool
+struct bufferPool {
+	uint64_t head;  // tag << 32 | (index + 1) of the top page, 0 if empty
+	uint32_t next[BUFFER_POOL_MAX_CHUNKS * BUFFER_POOL_PAGES];  // index + 1 of the page below
+	struct bufferPage *chunks[BUFFER_POOL_MAX_CHUNKS];
+	size_t chunksCnt;
+	size_t used;
+	pthread_mutex_t mutex;
+} bufferPool = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static inline struct bufferPage *bufferPoolPage(uint32_t index) {
+	return &bufferPool.chunks[index / BUFFER_POOL_PAGES][index % BUFFER_POOL_PAGES];
+}
+
+void bufferPoolPush(uint32_t index) {
+	uint64_t head;
+	do {
+		head = bufferPool.head;
+		bufferPool.next[index] = (uint32_t)head;
+	} while (!__sync_bool_compare_and_swap(&bufferPool.head, head, ((head >> 32) + 1) << 32 | (index + 1)));
+}
+
+struct bufferPage *bufferPoolPop() {
+	uint64_t head;
+	uint32_t index;
+	do {
+		head = bufferPool.head;
+		if (!(uint32_t)head) return NULL;
+		index = (uint32_t)head - 1;
+	} while (!__sync_bool_compare_and_swap(&bufferPool.head, head, ((head >> 32) + 1) << 32 | bufferPool.next[index]));
+	struct bufferPage *page = bufferPoolPage(index);
+	page->index = index;
+	return page;
+}
+
+// returns false if no more memory is available
+bool bufferPoolGrow() {
+	pthread_mutex_lock(&bufferPool.mutex);
+	bool ret = false;
+	if (bufferPool.chunksCnt < BUFFER_POOL_MAX_CHUNKS) {
+		struct bufferPage *chunk = NULL;
+#ifdef __WIN32__
+		chunk = _aligned_malloc(BUFFER_POOL_PAGES * sizeof(struct bufferPage), 64);
+#else
+		if (posix_memalign((void **)&chunk, 64, BUFFER_POOL_PAGES * sizeof(struct bufferPage)) != 0) chunk = NULL;
+#endif
+		if (chunk) {
+			uint32_t first = bufferPool.chunksCnt * BUFFER_POOL_PAGES;
+			bufferPool.chunks[bufferPool.chunksCnt] = chunk;
+			__sync_synchronize();
+			bufferPool.chunksCnt++;
+			for (uint32_t i = BUFFER_POOL_PAGES; i > 0; i--) {
+				bufferPoolPush(first + i - 1);
+			}
+			ret = true;
+		}
+	}
+	pthread_mutex_unlock(&bufferPool.mutex);
+	return ret;
+}
+
+struct bufferPage *bufferPoolAlloc() {
+	struct bufferPage *page;
+	while (!(page = bufferPoolPop())) {
+		if (!bufferPoolGrow()) return NULL;
+	}
+	__sync_fetch_and_add(&bufferPool.used, 1);
+	return page;
+}
+
+void bufferPoolFree(struct bufferPage *page) {
+	__sync_fetch_and_sub(&bufferPool.used, 1);
+	bufferPoolPush(page->index);
+}
+
+void bufferPoolStats(size_t *usedPages, size_t *allocatedPages, size_t *pageSize) {
+	*usedPages = bufferPool.used;
+	*allocatedPages = bufferPool.chunksCnt * BUFFER_POOL_PAGES;
+	*pageSize = sizeof(struct bufferPage);
+}
+
+
+// --- buffer ---
+
+// only blocks around the current delay keep their pages;
+// they are taken by the writer and returned by the reader, at least one page behind its position
 struct audioBuffer {
 	bindex_t readPos;       // to be read
 	bindex_t writeLastPos;  // farest already written
 	bindex_t readTime;      // number of bufferReadNext calls
 	bindex_t lastJumpTime;  // readTime of last discontinuity
+	bindex_t releasePos;    // pages of preceding blocks were returned to the pool
 	double statAvgSq;
 	double statMaxSq;
 	bool statClear;
 	bool statEnabled;
 	bool fade;
-	size_t srvStatWait;
+	size_t srvStatWait;     // cumulative, written by reader
 	size_t srvStatSkip;
 	size_t srvStatLost;
 	size_t srvStatPlay;
+	size_t srvStatPrev[4]; // the above at the last bufferSrvStatsReset
 	int nullReads;
 	sample_t tmpBlock[BLOCK_SIZE];
-	bindex_t blockTime[BUFFER_BLOCKS];    // readTime when written; block empty iff 0
-	sample_t data[BUFFER_BLOCKS * BLOCK_SIZE];
+	uint64_t used[BUFFER_BLOCKS / 64];      // bitmap of written blocks
+	uint64_t recovered[BUFFER_BLOCKS / 64]; // bitmap of used blocks written from redundant data
+	float lossAvg; // avg number of lost or recovered blocks per played block
+	struct bufferPage *pages[BUFFER_BLOCKS / BUFFER_PAGE_BLOCKS];
+
+	// jitter model for skipping decisions, kept by the writer: slack of a block is its position minus readTime of its arrival,
+	// lateness is the slack below the reference (max) slack; its decaying histogram gives the playout target
+	float jitterHist[BUFFER_JITTER_BINS]; // weights of arrivals by lateness, the last bin incl. larger
+	float jitterTotal;    // sum of the histogram
+	float jitterWeight;   // of the next arrival, growing instead of decaying the histogram
+	int32_t jitterRef;    // slack of lateness 0
+	size_t jitterCnt;     // arrivals since the histogram was cleared
+	int32_t jitterOffset; // target of readPos - readTime, i.e. min slack of blocks to be played in time
+	int jitterLate;       // lateness quantile given by BUFFER_LATE_TARGET
+	bool jitterValid;
+
+	// packet loss concealment by repeating the last pitch period of the returned sound
+	sample_t plcHistory[BUFFER_PLC_HISTORY_BLOCKS][BLOCK_SIZE]; // ring of returned blocks
+	size_t plcHistoryPos;
+	sample_t plcData[BUFFER_PLC_MAX_PERIOD * (BLOCK_SIZE / MONO_BLOCK_SIZE)]; // period being repeated
+	int plcPeriod;   // frames
+	int plcPhase;    // frame of plcData to be returned next
+	int plcBlocks;   // concealed blocks since the last returned one, 0 if not concealing
+
+	// time-scale modification: the stream is returned from frame tsmShift of block readPos
+	// and it is shortened or lengthened by splicing similar segments
+	int tsmShift;
+	int tsmWait;     // frames to be returned before the next splice
 };
 
+static inline bool bufferUsed(struct audioBuffer *buf, bindex_t pos) {
+	return (buf->used[pos / 64 % (BUFFER_BLOCKS / 64)] >> (pos % 64)) & 1;
+}
+
+static inline bool bufferRecovered(struct audioBuffer *buf, bindex_t pos) {
+	return (buf->recovered[pos / 64 % (BUFFER_BLOCKS / 64)] >> (pos % 64)) & 1;
+}
+
+// bit i is set iff block pos + i is used
+static inline uint64_t bufferUsedBits(struct audioBuffer *buf, bindex_t pos) {
+	size_t shift = pos % 64;
+	uint64_t bits = buf->used[pos / 64 % (BUFFER_BLOCKS / 64)] >> shift;
+	if (shift) bits |= buf->used[(pos / 64 + 1) % (BUFFER_BLOCKS / 64)] << (64 - shift);
+	return bits;
+}
+
+// marks blocks in [from, to) as empty, at most BUFFER_BLOCKS / 64 steps
+void bufferUnsetUsed(struct audioBuffer *buf, bindex_t from, bindex_t to) {
+	if ((bindex_t)(to - from) >= BUFFER_BLOCKS) {
+		memset(buf->used, 0, sizeof(buf->used));
+		return;
+	}
+	while (from != to) {
+		size_t shift = from % 64;
+		size_t cnt = 64 - shift;
+		if (cnt > (bindex_t)(to - from)) cnt = to - from;
+		uint64_t mask = (cnt == 64 ? ~(uint64_t)0 : (((uint64_t)1 << cnt) - 1) << shift);
+		buf->used[from / 64 % (BUFFER_BLOCKS / 64)] &= ~mask;
+		from += cnt;
+	}
+}
+
+// returns the first pos in [from, to] such that blocks pos and pos + 1 are used, or to + 1
+bindex_t bufferFindUsedPair(struct audioBuffer *buf, bindex_t from, bindex_t to) {
+	for (bindex_t pos = from; (int32_t)(to - pos) >= 0; pos += 63) {
+		uint64_t bits = bufferUsedBits(buf, pos);
+		uint64_t pairs = bits & (bits >> 1) & ~((uint64_t)1 << 63);
+		if (pairs) {
+			pos += __builtin_ctzll(pairs);
+			return ((int32_t)(to - pos) >= 0 ? pos : to + 1);
+		}
+	}
+	return to + 1;
+}
+
+// moves the histogram by the given number of bins (positive to higher lateness)
+void bufferJitterShift(struct audioBuffer *buf, int shift) {
+	if (shift > 0) {
+		float last = 0;
+		for (int i = BUFFER_JITTER_BINS - 1 - shift; (i < BUFFER_JITTER_BINS) && (i >= 0); i++) {
+			last += buf->jitterHist[i];
+		}
+		if (shift >= BUFFER_JITTER_BINS) {
+			last = buf->jitterTotal;
+			memset(buf->jitterHist, 0, sizeof(buf->jitterHist));
+		} else {
+			memmove(buf->jitterHist + shift, buf->jitterHist, (BUFFER_JITTER_BINS - shift) * sizeof(float));
+			memset(buf->jitterHist, 0, shift * sizeof(float));
+		}
+		buf->jitterHist[BUFFER_JITTER_BINS - 1] = last;
+	} else if (shift < 0) {
+		shift = -shift;
+		float first = 0;
+		for (int i = 0; i <= shift; i++) {
+			first += buf->jitterHist[i];
+		}
+		memmove(buf->jitterHist + 1, buf->jitterHist + shift + 1, (BUFFER_JITTER_BINS - shift - 1) * sizeof(float));
+		memset(buf->jitterHist + BUFFER_JITTER_BINS - shift, 0, shift * sizeof(float));
+		buf->jitterHist[0] = first;
+	}
+}
+
+// recomputes the playout target from the histogram, lowers the reference if there are too few early arrivals
+void bufferJitterUpdate(struct audioBuffer *buf) {
+	float limit = buf->jitterTotal * BUFFER_LATE_TARGET;
+	float sum = 0;
+	int early = 0;
+	while ((early < BUFFER_JITTER_BINS - 1) && ((sum += buf->jitterHist[early]) <= limit)) early++;
+	if (early > 0) {
+		bufferJitterShift(buf, -early);
+		buf->jitterRef -= early;
+	}
+
+	int late = BUFFER_JITTER_BINS - 1;
+	sum = 0;
+	while ((late > 0) && ((sum += buf->jitterHist[late]) <= limit)) late--;
+
+	buf->jitterLate = late;
+	buf->jitterOffset = buf->jitterRef - late;
+	__sync_synchronize();
+	buf->jitterValid = true;
+}
+
+// called by the writer for each arrived block with readTime read from the buffer
+void bufferJitterAdd(struct audioBuffer *buf, bindex_t pos, bindex_t readTime) {
+	int32_t slack = pos - readTime;
+	if (!buf->jitterCnt) {
+		buf->jitterRef = slack;
+	} else if (slack > buf->jitterRef) {
+		bufferJitterShift(buf, slack - buf->jitterRef);
+		buf->jitterRef = slack;
+	}
+	int32_t late = buf->jitterRef - slack;
+	if (late >= BUFFER_JITTER_BINS) late = BUFFER_JITTER_BINS - 1;
+
+	buf->jitterHist[late] += buf->jitterWeight;
+	buf->jitterTotal += buf->jitterWeight;
+	buf->jitterWeight /= BUFFER_JITTER_MULTIPLIER;
+	if (buf->jitterWeight > 1e6) {
+		for (size_t i = 0; i < BUFFER_JITTER_BINS; i++) {
+			buf->jitterHist[i] /= buf->jitterWeight;
+		}
+		buf->jitterTotal /= buf->jitterWeight;
+		buf->jitterWeight = 1;
+	}
+
+	if (++buf->jitterCnt % BUFFER_SLACK_PERIOD == 0) {
+		bufferJitterUpdate(buf);
+	}
+}
+
+// playout target: blocks with lower slack are expected to arrive late, INT32_MAX if not known yet
+int32_t bufferJitterOffset(struct audioBuffer *buf) {
+	if (!buf->jitterValid) return INT32_MAX;
+	__sync_synchronize();
+	return buf->jitterOffset;
+}
+
+// page of the given block if it is held by the buffer
+static inline struct bufferPage *bufferPageOf(struct audioBuffer *buf, bindex_t pos) {
+	struct bufferPage *page = buf->pages[pos / BUFFER_PAGE_BLOCKS % (BUFFER_BLOCKS / BUFFER_PAGE_BLOCKS)];
+	if (page && (page->base == pos - pos % BUFFER_PAGE_BLOCKS)) return page;
+	return NULL;
+}
+
+// returns pages of blocks before pos (except the preceding page) to the pool
+void bufferReleaseBefore(struct audioBuffer *buf, bindex_t pos) {
+	bindex_t target = pos - pos % BUFFER_PAGE_BLOCKS - BUFFER_PAGE_BLOCKS;
+	if ((int32_t)(target - buf->releasePos) < 0) return; // after clearing or lengthening the stream
+	if ((bindex_t)(target - buf->releasePos) > BUFFER_BLOCKS) {
+		buf->releasePos = target - BUFFER_BLOCKS;
+	}
+	for (; buf->releasePos != target; buf->releasePos += BUFFER_PAGE_BLOCKS) {
+		struct bufferPage **slot = &buf->pages[buf->releasePos / BUFFER_PAGE_BLOCKS % (BUFFER_BLOCKS / BUFFER_PAGE_BLOCKS)];
+		struct bufferPage *page = *slot;
+		if (page && ((bindex_t)(page->base - target) >= BUFFER_BLOCKS) &&  // not already written ahead
+				__sync_bool_compare_and_swap(slot, page, NULL)) {
+			bufferPoolFree(page);
+		}
+	}
+}
+
+// returns all pages to the pool, no writing can be in progress
+void bufferRelease(struct audioBuffer *buf) {
+	for (size_t i = 0; i < BUFFER_BLOCKS / BUFFER_PAGE_BLOCKS; i++) {
+		struct bufferPage *page = buf->pages[i];
+		if (page && __sync_bool_compare_and_swap(&buf->pages[i], page, NULL)) {
+			bufferPoolFree(page);
+		}
+	}
+}
+
 // fading within one block in case of discontinuity slightly reduces crackling
 float bufferFade(int index) {
 	return ((float)index)/BLOCK_SIZE;
 }
 
+// --- packet loss concealment ---
+
+// pitch period (in frames) of the end of the given history,
+// found by normalized cross-correlation first on 4x decimated mono signal, then refined
+int bufferPlcPeriod(const sample_t *hist) {
+	const int channels = BLOCK_SIZE / MONO_BLOCK_SIZE;
+	const int frames = BUFFER_PLC_HISTORY_BLOCKS * MONO_BLOCK_SIZE;
+	const int window = 2 * MONO_BLOCK_SIZE;
+
+	// 12-bit samples, so that sums of products over the window fit in 32 bits
+	int32_t dec[frames / 4];
+	for (int i = 0; i < frames / 4; i++) {
+		int32_t sum = 0;
+		for (int j = 0; j < 4 * channels; j++) {
+			sum += hist[4 * channels * i + j];
+		}
+		dec[i] = sum / (4 * channels * 16);
+	}
+
+	const int32_t *cur = dec + (frames - window) / 4;
+	int32_t energy = 1;
+	for (int i = 0; i < window / 4; i++) {
+		energy += cur[i - BUFFER_PLC_MIN_PERIOD / 4] * cur[i - BUFFER_PLC_MIN_PERIOD / 4];
+	}
+	int best = BUFFER_PLC_MIN_PERIOD;
+	float bestScore = 0;
+	for (int lag = BUFFER_PLC_MIN_PERIOD / 4; lag <= BUFFER_PLC_MAX_PERIOD / 4; lag++) {
+		const int32_t *prev = cur - lag;
+		int32_t corr = 0;
+		for (int i = 0; i < window / 4; i++) {
+			corr += cur[i] * prev[i];
+		}
+		float score = (corr > 0 ? (float)corr * corr / energy : 0);
+		if (score > bestScore) {
+			bestScore = score;
+			best = 4 * lag;
+		}
+		energy += prev[-1] * prev[-1] - prev[window / 4 - 1] * prev[window / 4 - 1];
+	}
+
+	int from = best - 3, to = best + 3;
+	if (from < BUFFER_PLC_MIN_PERIOD) from = BUFFER_PLC_MIN_PERIOD;
+	if (to > BUFFER_PLC_MAX_PERIOD) to = BUFFER_PLC_MAX_PERIOD;
+	double bestScoreFine = 0;
+	for (int lag = from; lag <= to; lag++) {
+		int64_t corr = 0, energy = 1;
+		for (int i = (frames - window) * channels; i < frames * channels; i++) {
+			corr += (int64_t)hist[i] * hist[i - lag * channels];
+			energy += (int64_t)hist[i - lag * channels] * hist[i - lag * channels];
+		}
+		double score = (corr > 0 ? (double)corr * corr / energy : 0);
+		if (score > bestScoreFine) {
+			bestScoreFine = score;
+			best = lag;
+		}
+	}
+	return best;
+}
+
+// gain of the concealed sound at the beginning of the given concealed block
+static inline float bufferPlcGain(int block) {
+	if (block <= BUFFER_PLC_BLOCKS / 2) return 1;
+	return (float)(BUFFER_PLC_BLOCKS - block) / (BUFFER_PLC_BLOCKS - BUFFER_PLC_BLOCKS / 2);
+}
+
+void bufferPlcStart(struct audioBuffer *buf) {
+	const int channels = BLOCK_SIZE / MONO_BLOCK_SIZE;
+	sample_t hist[BUFFER_PLC_HISTORY_BLOCKS * BLOCK_SIZE];
+	for (size_t i = 0; i < BUFFER_PLC_HISTORY_BLOCKS; i++) {
+		memcpy(hist + i * BLOCK_SIZE, buf->plcHistory[(buf->plcHistoryPos + i) % BUFFER_PLC_HISTORY_BLOCKS], sizeof(buf->plcHistory[0]));
+	}
+	buf->plcPeriod = bufferPlcPeriod(hist);
+	memcpy(buf->plcData, hist + (BUFFER_PLC_HISTORY_BLOCKS * MONO_BLOCK_SIZE - buf->plcPeriod) * channels,
+			buf->plcPeriod * channels * sizeof(sample_t));
+	buf->plcPhase = 0;
+	buf->plcBlocks = 0;
+}
+
+// writes the next concealed block; concealment has to be started before
+void bufferPlcNext(struct audioBuffer *buf, sample_t *block) {
+	const int channels = BLOCK_SIZE / MONO_BLOCK_SIZE;
+	float gain = bufferPlcGain(buf->plcBlocks);
+	float gainStep = (bufferPlcGain(buf->plcBlocks + 1) - gain) / MONO_BLOCK_SIZE;
+	for (int i = 0; i < MONO_BLOCK_SIZE; i++) {
+		for (int c = 0; c < channels; c++) {
+			block[i * channels + c] = buf->plcData[buf->plcPhase * channels + c] * gain;
+		}
+		if (++buf->plcPhase >= buf->plcPeriod) buf->plcPhase = 0;
+		gain += gainStep;
+	}
+	buf->plcBlocks++;
+}
+
+void bufferPlcHistoryAdd(struct audioBuffer *buf, const sample_t *block) {
+	memcpy(buf->plcHistory[buf->plcHistoryPos], block, sizeof(buf->plcHistory[0]));
+	buf->plcHistoryPos = (buf->plcHistoryPos + 1) % BUFFER_PLC_HISTORY_BLOCKS;
+}
+
+// --- time-scale modification ---
+
+// copies cnt frames of the stream starting at frame shift of block pos
+void bufferCopyFrames(struct audioBuffer *buf, bindex_t pos, int shift, int cnt, sample_t *out) {
+	const int channels = BLOCK_SIZE / MONO_BLOCK_SIZE;
+	while (cnt > 0) {
+		int n = MONO_BLOCK_SIZE - shift;
+		if (n > cnt) n = cnt;
+		struct bufferPage *page = bufferPageOf(buf, pos);
+		if (page) {
+			memcpy(out, page->data + (pos % BUFFER_PAGE_BLOCKS) * BLOCK_SIZE + shift * channels, n * channels * sizeof(sample_t));
+		} else {
+			memset(out, 0, n * channels * sizeof(sample_t));
+		}
+		out += n * channels;
+		cnt -= n;
+		pos++;
+		shift = 0;
+	}
+}
+
+// lag (in frames, from [from, to]) of the segment of the given frames most similar to the block at frame pos;
+// candidates start at frame pos + dir * lag, they are searched on 4x decimated mono signal first, then refined;
+// pos, to and cnt have to be divisible by 4
+int bufferTsmLag(const sample_t *frames, int cnt, int pos, int dir, int from, int to) {
+	const int channels = BLOCK_SIZE / MONO_BLOCK_SIZE;
+	const int window = MONO_BLOCK_SIZE;
+
+	// 12-bit samples, so that sums of products over the window fit in 32 bits
+	int32_t dec[(MONO_BLOCK_SIZE + BUFFER_TSM_MAX_LAG) / 4];
+	for (int i = 0; i < cnt / 4; i++) {
+		int32_t sum = 0;
+		for (int j = 0; j < 4 * channels; j++) {
+			sum += frames[4 * channels * i + j];
+		}
+		dec[i] = sum / (4 * channels * 16);
+	}
+
+	const int32_t *cur = dec + pos / 4;
+	int best = from;
+	float bestScore = 0;
+	for (int lag = (from + 3) / 4; lag <= to / 4; lag++) {
+		const int32_t *cand = cur + dir * lag;
+		int32_t corr = 0, energy = 1;
+		for (int i = 0; i < window / 4; i++) {
+			corr += cur[i] * cand[i];
+			energy += cand[i] * cand[i];
+		}
+		float score = (corr > 0 ? (float)corr * corr / energy : 0);
+		if (score > bestScore) {
+			bestScore = score;
+			best = 4 * lag;
+		}
+	}
+
+	int refFrom = best - 3, refTo = best + 3;
+	if (refFrom < from) refFrom = from;
+	if (refTo > to) refTo = to;
+	double bestScoreFine = 0;
+	for (int lag = refFrom; lag <= refTo; lag++) {
+		const sample_t *a = frames + pos * channels, *b = frames + (pos + dir * lag) * channels;
+		int64_t corr = 0, energy = 1;
+		for (int i = 0; i < window * channels; i++) {
+			corr += (int64_t)a[i] * b[i];
+			energy += (int64_t)b[i] * b[i];
+		}
+		double score = (corr > 0 ? (double)corr * corr / energy : 0);
+		if (score > bestScoreFine) {
+			bestScoreFine = score;
+			best = lag;
+		}
+	}
+	return best;
+}
+
+// returns the next block of the stream crossfaded to a similar segment ahead (dir 1, shortening the stream)
+// or behind (dir -1, lengthening it) and moves the read position after it, NULL if there are not enough data around
+sample_t *bufferTsmSplice(struct audioBuffer *buf, int dir) {
+	const int channels = BLOCK_SIZE / MONO_BLOCK_SIZE;
+	bindex_t readPos = buf->readPos;
+	int shift = buf->tsmShift;
+
+	// frames available in consecutive used blocks ahead or behind
+	int avail;
+	if (dir > 0) {
+		uint64_t bits = ~bufferUsedBits(buf, readPos);
+		int blocks = (bits ? __builtin_ctzll(bits) : 64);
+		if ((int32_t)(buf->writeLastPos - readPos) + 1 < blocks) blocks = buf->writeLastPos - readPos + 1;
+		avail = blocks * MONO_BLOCK_SIZE - shift - MONO_BLOCK_SIZE;
+	} else {
+		uint64_t bits = ~bufferUsedBits(buf, readPos - 64);
+		int blocks = (bits ? __builtin_clzll(bits) : 64);
+		avail = blocks * MONO_BLOCK_SIZE + shift;
+	}
+	int to = (avail < BUFFER_TSM_MAX_LAG ? avail : BUFFER_TSM_MAX_LAG) & ~3;
+	if (to < BUFFER_PLC_MIN_PERIOD) return NULL;
+
+	sample_t frames[(MONO_BLOCK_SIZE + BUFFER_TSM_MAX_LAG) * channels];
+	int pos = (dir > 0 ? 0 : to);
+	if (dir > 0) {
+		bufferCopyFrames(buf, readPos, shift, MONO_BLOCK_SIZE + to, frames);
+	} else {
+		int frame = shift - to;
+		bindex_t first = readPos - (MONO_BLOCK_SIZE - 1 - frame) / MONO_BLOCK_SIZE;
+		bufferCopyFrames(buf, first, frame - (int32_t)(first - readPos) * MONO_BLOCK_SIZE, MONO_BLOCK_SIZE + to, frames);
+	}
+	int lag = bufferTsmLag(frames, MONO_BLOCK_SIZE + to, pos, dir, BUFFER_PLC_MIN_PERIOD, to);
+
+	const sample_t *a = frames + pos * channels, *b = frames + (pos + dir * lag) * channels;
+	for (int i = 0; i < MONO_BLOCK_SIZE; i++) {
+		float w = (float)i / MONO_BLOCK_SIZE;
+		for (int c = 0; c < channels; c++) {
+			buf->tmpBlock[i * channels + c] = a[i * channels + c] * (1 - w) + b[i * channels + c] * w;
+		}
+	}
+
+	int frame = shift + MONO_BLOCK_SIZE + dir * lag;
+	int blocks = (frame >= 0 ? frame / MONO_BLOCK_SIZE : -((MONO_BLOCK_SIZE - 1 - frame) / MONO_BLOCK_SIZE));
+	buf->tsmShift = frame - blocks * MONO_BLOCK_SIZE;
+	buf->readPos = readPos + blocks;
+	buf->tsmWait = lag / BUFFER_TSM_RATE;
+	return buf->tmpBlock;
+}
+
 void bufferClear(struct audioBuffer *buf, bindex_t readPos) {
+	bufferRelease(buf);
 	buf->readPos = readPos;
+	buf->releasePos = readPos;
 	buf->readTime = 1;
 	buf->lastJumpTime = 0;
 	buf->writeLastPos = 0;
 	buf->fade = true;
 	buf->nullReads = 0;
+	buf->lossAvg = 0;
+	buf->plcBlocks = 0;
+	buf->plcHistoryPos = 0;
+	buf->tsmShift = 0;
+	buf->tsmWait = 0;
+	memset(buf->plcHistory, 0, sizeof(buf->plcHistory));
 	buf->statAvgSq = 0;
 	buf->statMaxSq = 0;
 	buf->statClear = false;
-	for (int i = 0; i < BUFFER_BLOCKS; i++) {
-		buf->blockTime[i] = 0;
-	}
+	memset(buf->used, 0, sizeof(buf->used));
+	memset(buf->jitterHist, 0, sizeof(buf->jitterHist));
+	buf->jitterTotal = 0;
+	buf->jitterWeight = 1;
+	buf->jitterCnt = 0;
+	buf->jitterLate = 0;
+	buf->jitterValid = false;
 	buf->srvStatWait = 0;
 	buf->srvStatSkip = 0;
 	buf->srvStatLost = 0;
 	buf->srvStatPlay = 0;
+	memset(buf->srvStatPrev, 0, sizeof(buf->srvStatPrev));
 }
 
-sample_t *bufferRead(struct audioBuffer *buf, bindex_t pos, bool fadeIn, bool fadeOut) {
+// to be called on uninitialized buffer instead of bufferClear
+void bufferInit(struct audioBuffer *buf, bindex_t readPos) {
+	for (size_t i = 0; i < BUFFER_BLOCKS / BUFFER_PAGE_BLOCKS; i++) {
+		buf->pages[i] = NULL;
+	}
+	bufferClear(buf, readPos);
+}
+
+// tmpBlock is used for returning silent or faded data,
+// so that more threads can read the buffer simultaneously using their own tmpBlocks
+sample_t *bufferReadTo(struct audioBuffer *buf, bindex_t pos, bool fadeIn, bool fadeOut, sample_t *tmpBlock) {
 	sample_t *retData;
+	struct bufferPage *page = bufferPageOf(buf, pos);
 
-	if ((fadeIn && fadeOut) ||
+	if ((fadeIn && fadeOut) || !page ||
 			(pos + BUFFER_BLOCKS <= buf->writeLastPos) || (pos > buf->writeLastPos) ||
-			(!buf->blockTime[pos % BUFFER_BLOCKS])) {
-		retData = buf->tmpBlock;
+			!bufferUsed(buf, pos)) {
+		retData = tmpBlock;
 		memset(retData, 0, BLOCK_SIZE * sizeof(sample_t));
 		return retData;
 	}
 
-	retData = buf->data + (pos % BUFFER_BLOCKS) * BLOCK_SIZE;
+	retData = page->data + (pos % BUFFER_PAGE_BLOCKS) * BLOCK_SIZE;
 	if (fadeIn || fadeOut) {
 		// fade-in/fade-out should be performed within the block because of some discontinuity
-		sample_t *tmpData = buf->tmpBlock;
+		sample_t *tmpData = tmpBlock;
 		if (fadeOut) {
 			for (int i = 0; i < BLOCK_SIZE; i++) {
 				tmpData[i] = retData[i] * bufferFade(BLOCK_SIZE - i - 1);
@@ -92,6 +645,10 @@ sample_t *bufferRead(struct audioBuffer *buf, bindex_t pos, bool fadeIn, bool fa
 	return retData;
 }
 
+sample_t *bufferRead(struct audioBuffer *buf, bindex_t pos, bool fadeIn, bool fadeOut) {
+	return bufferReadTo(buf, pos, fadeIn, fadeOut, buf->tmpBlock);
+}
+
 // low-latency reading
 sample_t *bufferReadNext(struct audioBuffer *buf) {
 	__sync_synchronize();
@@ -104,52 +661,57 @@ sample_t *bufferReadNext(struct audioBuffer *buf) {
 		// writing occurred too far apart reading, this shouldn't happen
 		buf->readPos = readPos = writeLastPos - BUFFER_BLOCKS/2;
 		buf->fade = true; // no fade out before it
+		buf->plcBlocks = 0;
+		buf->tsmShift = 0;
 #ifdef DEBUG_BUFFER_VERBOSE
 		printf("Long jump\n");
 #endif
 	}
 
-	// check whether to skip some data (to lower delay)
-	int skip = 0;
-	if (buf->lastJumpTime + BUFFER_SKIP_PERIOD <= buf->readTime) {
-		skip = writeLastPos - readPos - 1;
-		if (skip > BUFFER_SKIP_PERIOD) skip = BUFFER_SKIP_PERIOD;
-		int seenBlocks = 0;
-		for (bindex_t i = writeLastPos; (skip > 0) && (i + BUFFER_DES_JUMP_PERIOD > readPos) && (i > 0); i--) {
-			if (buf->blockTime[i % BUFFER_BLOCKS]) {
-				int val = i - readPos + readTime - buf->blockTime[i % BUFFER_BLOCKS] - 2; // skip allowed by i-th block
-				if (skip > val) {
-					skip = val;
-				}
-				seenBlocks++;
-			}
-			if ((i + BUFFER_DES_JUMP_PERIOD <= readPos + skip) && (seenBlocks >= BUFFER_DES_JUMP_PERIOD)) break;
-		}
-		if ((skip <= 0) || !buf->blockTime[(readPos + skip) % BUFFER_BLOCKS] || !buf->blockTime[(readPos + skip + 1) % BUFFER_BLOCKS]) skip = 0;
+	// check whether to lower delay by skipping some data or by shortening the stream, or to lengthen it
+	int skip = 0, tsm = 0;
+	int64_t excess = (int32_t)(writeLastPos - readPos) - 1;
+	int32_t slack = bufferJitterOffset(buf);
+	if (slack != INT32_MAX) {
+		int64_t val = (int64_t)slack + (int32_t)(readTime - readPos) - 2; // lowering allowed by the jitter model
+		if (excess > val) excess = val;
+		if (val < -1) tsm = -1;
 	}
-
-	bool curUsed = (readPos <= buf->writeLastPos) && (buf->blockTime[readPos % BUFFER_BLOCKS]);
-
-	// insert one empty block if this one arrived just on time and so previous was faded
-	if (buf->nullReads == -1) {
-		if (curUsed && !skip) {
-			curUsed = false;
-		} else {
-			buf->nullReads = 0;
+	if (excess > BUFFER_TSM_MAX_BLOCKS) {
+		if (buf->lastJumpTime + BUFFER_SKIP_PERIOD <= buf->readTime) {
+			skip = (excess > BUFFER_SKIP_PERIOD ? BUFFER_SKIP_PERIOD : excess);
+			if (!bufferUsed(buf, readPos + skip) || !bufferUsed(buf, readPos + skip + 1)) skip = 0;
 		}
+	} else if (excess > 0) {
+		tsm = 1;
 	}
+	if (buf->tsmWait > 0) {
+		buf->tsmWait -= MONO_BLOCK_SIZE;
+		tsm = 0;
+	}
+
+	bool curUsed = (readPos <= buf->writeLastPos) && bufferUsed(buf, readPos) &&
+		(!buf->tsmShift || ((readPos + 1 <= buf->writeLastPos) && bufferUsed(buf, readPos + 1)));
 
 	// check whether we are waiting too long for a packet, so it can be missed and should be skiped
+	int lossEvents = 0;
 	if (!curUsed && !skip) {
-		bool used = false;
-		for (int i = 0; i <= buf->nullReads; i++) {
-			if (readPos + i + 1 > buf->writeLastPos) break;
-			bool nextUsed = (buf->blockTime[(readPos + i + 1) % BUFFER_BLOCKS]);
-			if (used && nextUsed) {
+		bindex_t last = readPos + buf->nullReads;
+		if ((int32_t)(buf->writeLastPos - 1 - last) < 0) last = buf->writeLastPos - 1;
+		if ((buf->nullReads > 0) && ((int32_t)(last - readPos) > 0)) {
+			int i = bufferFindUsedPair(buf, readPos + 1, last) - readPos;
+			if (i <= (int32_t)(last - readPos)) {
+				if (buf->tsmShift && bufferUsed(buf, readPos)) {
+					// the stream was returned from the middle of block readPos, its rest is lost
+					i--;
+					readPos++;
+				}
 				readPos += i;
 				buf->readPos = readPos;
+				buf->tsmShift = 0;
 				curUsed = true;
 				buf->srvStatLost += i;
+				lossEvents += i;
 				buf->nullReads -= i;
 				if (buf->nullReads) {
 					buf->lastJumpTime = buf->readTime;
@@ -157,25 +719,52 @@ sample_t *bufferReadNext(struct audioBuffer *buf) {
 #ifdef DEBUG_BUFFER_VERBOSE
 				printf("lost %d, readPos %d, writePos %d\n", i, readPos, buf->writeLastPos);
 #endif
-				break;
 			}
-			used = nextUsed;
 		}
 	}
 
-	bool fadeOut = skip || (!buf->blockTime[(readPos + 1) % BUFFER_BLOCKS]);
+	// missing blocks are concealed, so only jumps are faded
+	bool fadeOut = skip;
 
 	sample_t *retData = NULL;
 	if (curUsed && (!fadeOut || !buf->fade)) {
 
 		// a block is available and should be returned
-		buf->readPos = readPos + 1;
-		__sync_synchronize();
-		retData = bufferRead(buf, readPos, buf->fade, fadeOut);
+		if (tsm && !fadeOut && !buf->fade && !buf->plcBlocks && (retData = bufferTsmSplice(buf, tsm))) {
+			int32_t jump = buf->readPos - readPos - 1;
+			if (jump > 0) buf->srvStatSkip += jump;
+			if (jump < 0) buf->srvStatWait -= jump;
+		} else if (buf->tsmShift) {
+			buf->readPos = readPos + 1;
+			__sync_synchronize();
+			retData = buf->tmpBlock;
+			bufferCopyFrames(buf, readPos, buf->tsmShift, MONO_BLOCK_SIZE, retData);
+			for (int i = 0; i < BLOCK_SIZE; i++) {
+				if (buf->fade) retData[i] *= bufferFade(i);
+				if (fadeOut) retData[i] *= bufferFade(BLOCK_SIZE - i - 1);
+			}
+		} else {
+			buf->readPos = readPos + 1;
+			__sync_synchronize();
+			retData = bufferRead(buf, readPos, buf->fade, fadeOut);
+		}
+
+		if (buf->plcBlocks) {
+			// crossfade from the concealed sound
+			sample_t concealed[BLOCK_SIZE];
+			bufferPlcNext(buf, concealed);
+			for (int i = 0; i < BLOCK_SIZE; i++) {
+				buf->tmpBlock[i] = retData[i] * bufferFade(i) + concealed[i] * bufferFade(BLOCK_SIZE - i - 1);
+			}
+			retData = buf->tmpBlock;
+			buf->plcBlocks = 0;
+		}
 
 		buf->fade = fadeOut;
 
 		buf->srvStatPlay++;
+		lossEvents += bufferRecovered(buf, readPos);
+		buf->lossAvg = buf->lossAvg * FEC_LOSS_MULTIPLIER + lossEvents * (1 - FEC_LOSS_MULTIPLIER);
 		buf->srvStatWait += buf->nullReads;
 #ifdef DEBUG_BUFFER_VERBOSE
 		if (buf->nullReads > 0) {
@@ -184,13 +773,20 @@ sample_t *bufferReadNext(struct audioBuffer *buf) {
 #endif
 		buf->nullReads = 0;
 
-		if (fadeOut && !skip) buf->nullReads = -1; // special value; insert one empty block if the following will arrive on time
-
 	} else {
 
-		// we are waiting for some data, nothing is returned
-		memset(buf->tmpBlock, 0, BLOCK_SIZE * sizeof(sample_t));
+		// we are waiting for some data, the sound is concealed for a while, then silence is returned
 		retData = buf->tmpBlock;
+		if (!buf->fade) {
+			if (!buf->plcBlocks) bufferPlcStart(buf);
+			bufferPlcNext(buf, retData);
+			if (buf->plcBlocks >= BUFFER_PLC_BLOCKS) {
+				buf->plcBlocks = 0;
+				buf->fade = true;
+			}
+		} else {
+			memset(retData, 0, BLOCK_SIZE * sizeof(sample_t));
+		}
 		buf->nullReads++;
 
 #ifdef DEBUG_BUFFER_VERBOSE
@@ -200,7 +796,7 @@ sample_t *bufferReadNext(struct audioBuffer *buf) {
 			printf("read %d, write %d\n", readPos, writePos);
 			if (readPos > 0) {
 				for (size_t i = writePos; i >= readPos; i--) {
-					printf("%d", buf->blockTime[i % BUFFER_BLOCKS]);
+					printf("%d", bufferUsed(buf, i));
 				}
 				printf("\n");
 			}
@@ -223,6 +819,9 @@ sample_t *bufferReadNext(struct audioBuffer *buf) {
 
 	}
 
+	bufferReleaseBefore(buf, buf->readPos);
+	bufferPlcHistoryAdd(buf, retData);
+
 	if (buf->statEnabled) {
 		int64_t sum = 0, max = 0, cnt = 0;
 		for (size_t i = 0; i < BLOCK_SIZE; i++) {
@@ -248,31 +847,67 @@ sample_t *bufferReadNext(struct audioBuffer *buf) {
 				// tmpData[i] = retData[i] * bufferFade(i); XXX
 bool bufferWrite(struct audioBuffer *buf, bindex_t pos, const sample_t *data, bool add) { // TODO fadeIn, fadeOut
 	if (buf->writeLastPos < pos) {
-		do {
-			buf->blockTime[++buf->writeLastPos % BUFFER_BLOCKS] = 0;
-		} while (buf->writeLastPos < pos);
+		bufferUnsetUsed(buf, buf->writeLastPos + 1, pos + 1);
+		__sync_synchronize();
+		buf->writeLastPos = pos;
 		__sync_synchronize();
 	}
 
 	if (pos < buf->readPos) {
+		if (!add && ((bindex_t)(buf->readPos - pos) < BUFFER_JITTER_BINS)) {
+			bufferJitterAdd(buf, pos, buf->readTime); // too late, but still part of the distribution
+		}
 		return false;
 	}
 
-	if (!add || (!buf->blockTime[pos % BUFFER_BLOCKS])) {
-		memcpy(buf->data + (pos % BUFFER_BLOCKS) * BLOCK_SIZE, data, BLOCK_SIZE * sizeof(sample_t));
+	struct bufferPage **slot = &buf->pages[pos / BUFFER_PAGE_BLOCKS % (BUFFER_BLOCKS / BUFFER_PAGE_BLOCKS)];
+	struct bufferPage *page = *slot;
+	if (!page) {
+		page = bufferPoolAlloc();
+		if (!page) return false;
+		page->base = pos - pos % BUFFER_PAGE_BLOCKS;
+		__sync_synchronize();
+		*slot = page;
+	} else if (page->base != pos - pos % BUFFER_PAGE_BLOCKS) {
+		// not released by the reader yet, which may still be reading or just releasing it
+		return false;
+	}
+
+	sample_t *block = page->data + (pos % BUFFER_PAGE_BLOCKS) * BLOCK_SIZE;
+	bool used = bufferUsed(buf, pos);
+	if (!add) {
+		buf->recovered[pos / 64 % (BUFFER_BLOCKS / 64)] &= ~((uint64_t)1 << (pos % 64));
+	}
+	if (!add || !used) {
+		memcpy(block, data, BLOCK_SIZE * sizeof(sample_t));
 	} else {
-		sample_t *block = buf->data + (pos % BUFFER_BLOCKS) * BLOCK_SIZE;
 		for (size_t i = 0; i < BLOCK_SIZE; i++) {
 			block[i] += data[i];
 		}
 	}
 
-	__sync_synchronize();
-	buf->blockTime[pos % BUFFER_BLOCKS] = buf->readTime;
+	if (!used) {
+		bufferJitterAdd(buf, pos, buf->readTime);
+		__sync_synchronize();
+		buf->used[pos / 64 % (BUFFER_BLOCKS / 64)] |= (uint64_t)1 << (pos % 64);
+	}
 
 	return true;
 }
 
+// writes a block recovered from redundant data, unless it was already received
+bool bufferWriteRecovered(struct audioBuffer *buf, bindex_t pos, const sample_t *data) {
+	if ((pos <= buf->writeLastPos) && bufferUsed(buf, pos)) return false;
+	if (!bufferWrite(buf, pos, data, false)) return false;
+	buf->recovered[pos / 64 % (BUFFER_BLOCKS / 64)] |= (uint64_t)1 << (pos % 64);
+	return true;
+}
+
+// rate of lost blocks, incl. those recovered from redundant data
+float bufferLossRate(struct audioBuffer *buf) {
+	return buf->lossAvg;
+}
+
 bool bufferWriteNext(struct audioBuffer *buf, const sample_t *data, bool add) {
 	return bufferWrite(buf, buf->writeLastPos + 1, data, add);
 }
@@ -289,12 +924,29 @@ void bufferOutputStatsReset(struct audioBuffer *buf, bool enable) {
 	__sync_synchronize();
 }
 
-void bufferSrvStatsReset(struct audioBuffer *buf, size_t *play, size_t *lost, size_t *wait, size_t *skip, ssize_t *delay) {
+// target delay (in blocks over the earliest arrivals) given by the jitter model
+int bufferJitterTarget(struct audioBuffer *buf) {
+	return buf->jitterLate + 2;
+}
+
+// totals since clearing the buffer, can be read by any thread
+void bufferSrvStats(struct audioBuffer *buf, size_t *play, size_t *lost, size_t *wait, size_t *skip) {
 	__sync_synchronize();
-	*play = buf->srvStatPlay; buf->srvStatPlay = 0;
-	*lost = buf->srvStatLost; buf->srvStatLost = 0;
-	*wait = buf->srvStatWait; buf->srvStatWait = 0;
-	*skip = buf->srvStatSkip; buf->srvStatSkip = 0;
+	*play = buf->srvStatPlay;
+	*lost = buf->srvStatLost;
+	*wait = buf->srvStatWait;
+	*skip = buf->srvStatSkip;
+}
+
+// counts since the previous call, to be called by a single thread
+void bufferSrvStatsReset(struct audioBuffer *buf, size_t *play, size_t *lost, size_t *wait, size_t *skip, ssize_t *delay) {
+	size_t cur[4];
+	bufferSrvStats(buf, &cur[0], &cur[1], &cur[2], &cur[3]);
+	*play = cur[0] - buf->srvStatPrev[0];
+	*lost = cur[1] - buf->srvStatPrev[1];
+	*wait = cur[2] - buf->srvStatPrev[2];
+	*skip = cur[3] - buf->srvStatPrev[3];
+	memcpy(buf->srvStatPrev, cur, sizeof(cur));
 	*delay = buf->writeLastPos - buf->readPos + 1;
 }
 
@@ -0,0 +1,235 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   BACKING_AHEAD_BLOCKS
+ *   SAMPLE_RATE
+ *   MONO_BLOCK_SIZE
+ *   STEREO_BLOCK_SIZE
+ *   sample_t  (16 bits, little endian)
+ */
+
+// Backing track played from a memory-mapped file, WAV with 16-bit PCM at SAMPLE_RATE or raw 16-bit stereo:
+// a reader thread of its own copies stereo blocks from the mapping to a lock-free single-producer single-consumer ring
+// BACKING_AHEAD_BLOCKS ahead, so page faults on the file never block the consumer.
+// Seeking can be requested by any thread, it starts a new generation of blocks and the consumer skips the older ones.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BACKING_RING_SIZE (BACKING_AHEAD_BLOCKS + 1)
+#define BACKING_POLL_USEC 10000 // of the reader for seek requests and free space in the ring
+
+struct backingBlock {
+	size_t generation;
+	size_t pos; // block index within the track
+	sample_t data[STEREO_BLOCK_SIZE];
+};
+
+struct backingTrack {
+	const uint8_t *map;
+	size_t mapSize;
+	const uint8_t *data; // samples within the mapping
+	int channels;
+	size_t frames;
+	size_t blocksCnt;    // the last one may be partial
+
+	volatile size_t seekPos;
+	volatile size_t generation;    // of requested seek, incremented by each one
+	volatile size_t endGeneration; // the reader passed the end of the track since seek of this generation, 0 if not
+
+	struct backingBlock ring[BACKING_RING_SIZE];
+	volatile size_t writePos, readPos; // in blocks since start, written only by the reader and the consumer respectively
+	size_t underruns; // blocks not read ahead in time, written only by the consumer
+
+	pthread_t thread;
+	void (*threadInit)();
+	char name[64]; // file name without directories
+};
+
+static uint32_t backingGet32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint16_t backingGet16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+// finds samples in WAV file, returns error message or NULL
+static const char *backingTrackParseWav(struct backingTrack *bt) {
+	const uint8_t *p = bt->map + 12, *end = bt->map + bt->mapSize;
+	bool fmt = false;
+	while (end - p >= 8) {
+		uint32_t size = backingGet32(p + 4);
+		const uint8_t *body = p + 8;
+		if (!memcmp(p, "fmt ", 4) && (size >= 16) && (end - body >= 16)) {
+			uint16_t format = backingGet16(body);
+			bt->channels = backingGet16(body + 2);
+			if ((format != 1) && (format != 0xfffe)) return "not PCM";
+			if ((bt->channels < 1) || (bt->channels > 2)) return "not mono nor stereo";
+			if (backingGet32(body + 4) != SAMPLE_RATE) return "different sample rate";
+			if (backingGet16(body + 14) != 16) return "not 16-bit";
+			fmt = true;
+		} else if (!memcmp(p, "data", 4)) {
+			if (!fmt) return "data before format";
+			bt->data = body;
+			if ((size == UINT32_MAX) || (size > end - body)) size = end - body; // RF64 or unfinished
+			bt->frames = size / bt->channels / sizeof(sample_t);
+			return NULL;
+		}
+		if (size > end - body) break;
+		p = body + size + (size & 1);
+	}
+	return "no data found";
+}
+
+// copies the block at pos to out as stereo, padded with silence
+static void backingTrackCopy(struct backingTrack *bt, size_t pos, sample_t *out) {
+	size_t frame = pos * MONO_BLOCK_SIZE;
+	size_t cnt = bt->frames - frame < MONO_BLOCK_SIZE ? bt->frames - frame : MONO_BLOCK_SIZE;
+	const sample_t *in = (const sample_t *)bt->data + frame * bt->channels;
+	if (bt->channels == 2) {
+		memcpy(out, in, 2 * cnt * sizeof(sample_t));
+	} else {
+		for (size_t i = 0; i < cnt; i++) out[2 * i] = out[2 * i + 1] = in[i];
+	}
+	memset(out + 2 * cnt, 0, 2 * (MONO_BLOCK_SIZE - cnt) * sizeof(sample_t));
+}
+
+static void *backingTrackReader(void *btPtr) {
+	struct backingTrack *bt = btPtr;
+	if (bt->threadInit) bt->threadInit();
+	size_t generation = 0;
+	size_t pos = 0;
+	size_t blockBytes = MONO_BLOCK_SIZE * bt->channels * sizeof(sample_t);
+
+	while (true) {
+		if (bt->generation != generation) {
+			generation = bt->generation;
+			__sync_synchronize();
+			pos = bt->seekPos;
+		}
+		if ((pos >= bt->blocksCnt) || (bt->writePos - bt->readPos >= BACKING_RING_SIZE)) {
+			if (pos >= bt->blocksCnt) bt->endGeneration = generation;
+			usleep(BACKING_POLL_USEC);
+			continue;
+		}
+		if (pos % BACKING_AHEAD_BLOCKS == 0) { // the following part is being read by kernel meanwhile
+			size_t offset = (bt->data - bt->map + (pos + BACKING_AHEAD_BLOCKS) * blockBytes) & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+			if (offset < bt->mapSize) {
+				madvise((void *)(bt->map + offset), bt->mapSize - offset < BACKING_AHEAD_BLOCKS * blockBytes ?
+						bt->mapSize - offset : BACKING_AHEAD_BLOCKS * blockBytes, MADV_WILLNEED);
+			}
+		}
+		struct backingBlock *b = &bt->ring[bt->writePos % BACKING_RING_SIZE];
+		b->generation = generation;
+		b->pos = pos;
+		backingTrackCopy(bt, pos++, b->data);
+		__sync_synchronize();
+		bt->writePos++;
+	}
+	return NULL;
+}
+
+// --- interface ---
+
+// maps the file and starts reader thread, which calls threadInit if set;
+// returns NULL on error, printing its reason
+struct backingTrack *backingTrackOpen(const char *filename, void (*threadInit)()) {
+	struct backingTrack *bt = calloc(1, sizeof(struct backingTrack));
+	if (!bt) return NULL;
+	const char *error = NULL;
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if ((fd < 0) || (fstat(fd, &st) != 0)) {
+		error = strerror(errno);
+	} else if (!st.st_size) {
+		error = "empty file";
+	} else {
+		bt->mapSize = st.st_size;
+		bt->map = mmap(NULL, bt->mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (bt->map == MAP_FAILED) {
+			bt->map = NULL;
+			error = strerror(errno);
+		}
+	}
+	if (fd >= 0) close(fd);
+
+	if (!error) {
+		madvise((void *)bt->map, bt->mapSize, MADV_SEQUENTIAL);
+		if ((bt->mapSize >= 12) && (!memcmp(bt->map, "RIFF", 4) || !memcmp(bt->map, "RF64", 4)) && !memcmp(bt->map + 8, "WAVE", 4)) {
+			error = backingTrackParseWav(bt);
+		} else { // raw
+			bt->data = bt->map;
+			bt->channels = 2;
+			bt->frames = bt->mapSize / 2 / sizeof(sample_t);
+		}
+	}
+	if (!error && !bt->frames) error = "no samples";
+
+	bt->blocksCnt = (bt->frames + MONO_BLOCK_SIZE - 1) / MONO_BLOCK_SIZE;
+	bt->generation = 1;
+	bt->threadInit = threadInit;
+	const char *name = strrchr(filename, '/');
+	snprintf(bt->name, sizeof(bt->name), "%s", name ? name + 1 : filename);
+	if (!error && (pthread_create(&bt->thread, NULL, &backingTrackReader, bt) != 0)) error = "cannot create thread";
+
+	if (error) {
+		printf("Cannot open backing track '%s': %s.\n", filename, error);
+		if (bt->map) munmap((void *)bt->map, bt->mapSize);
+		free(bt);
+		return NULL;
+	}
+	pthread_detach(bt->thread);
+	return bt;
+}
+
+// duration in blocks
+size_t backingTrackBlocks(struct backingTrack *bt) {
+	return bt->blocksCnt;
+}
+
+// the following blocks will be read from pos, can be called by any thread
+void backingTrackSeek(struct backingTrack *bt, size_t pos) {
+	bt->seekPos = pos < bt->blocksCnt ? pos : bt->blocksCnt;
+	__sync_synchronize();
+	__sync_fetch_and_add(&bt->generation, 1);
+}
+
+// to be called by the consumer only, never blocks;
+// skips blocks read before the last seek, so that the reader can fill the ring meanwhile; returns the current generation
+size_t backingTrackSkipStale(struct backingTrack *bt) {
+	size_t generation = bt->generation;
+	while (bt->readPos != bt->writePos) {
+		__sync_synchronize();
+		if (bt->ring[bt->readPos % BACKING_RING_SIZE].generation == generation) break;
+		__sync_synchronize();
+		bt->readPos++;
+	}
+	return generation;
+}
+
+// to be called by the consumer only, never blocks;
+// returns position of the block read to out, -1 if it is not read ahead yet, -2 at the end of the track
+ssize_t backingTrackRead(struct backingTrack *bt, sample_t *out) {
+	size_t generation = backingTrackSkipStale(bt);
+	if (bt->readPos != bt->writePos) {
+		__sync_synchronize();
+		struct backingBlock *b = &bt->ring[bt->readPos % BACKING_RING_SIZE];
+		memcpy(out, b->data, sizeof(b->data));
+		size_t pos = b->pos;
+		__sync_synchronize();
+		bt->readPos++;
+		return pos;
+	}
+	if (bt->endGeneration == generation) return -2;
+	bt->underruns++;
+	return -1;
+}
@@ -11,6 +11,9 @@
 #include <errno.h>
 
 #include "stereoBuffer.h"
+#include "codec.h"
+#include "fec.h"
+#include "drift.h"
 #include "net.h"
 #include "tty.h"
 #include "audioIO.h"
@@ -24,7 +27,16 @@ PaStream *paInputStream = NULL, *paOutputStream = NULL;
 int inputChannels;
 int udpSocket = -1;
 pthread_t udpThread;
-uint8_t clientID;
+uint16_t clientID;
+uint8_t codecs = CODECS_SUPPORTED & ~CODECS_LOSSY; // accepted for download and used for upload
+enum codecType uploadCodec = CODEC_PCM;
+struct fecSender uploadFec;
+uint8_t uploadFecCopies = 0; // requested by the server
+struct resampler inputResampler, outputResampler; // compensating drift of sound card clocks against the server
+float inputDrift = 0;          // estimated by the server
+float outputDrift = 0;
+struct driftEstimator outputDriftEstimator;
+volatile bindex_t inputFrames = 0, outputFrames = 0; // processed by the sound card
 float aioLat = 0;
 float dBAdj = 20;
 char sHeloStr[SHELO_STR_LEN+1];
@@ -66,10 +78,15 @@ int outputCallback(const sample_t *input, sample_t *output, unsigned long frameC
 	}
 	if ((outputMode == OUTPUT_NULL) || (outputMode == OUTPUT_END)) {
 		blockStereo = sbufferRead(&outputBuffer, 0, true, true);
+		memcpy(output, blockStereo, STEREO_BLOCK_SIZE * sizeof(sample_t));
 	} else {
-		blockStereo = sbufferReadNext(&outputBuffer);
+		double step = 1 / (1 + outputDrift);
+		while (!resamplerReady(&outputResampler, MONO_BLOCK_SIZE, step)) {
+			resamplerPut(&outputResampler, sbufferReadNext(&outputBuffer), MONO_BLOCK_SIZE);
+		}
+		resamplerGet(&outputResampler, output, MONO_BLOCK_SIZE, step);
 	}
-	memcpy(output, blockStereo, STEREO_BLOCK_SIZE * sizeof(sample_t));
+	outputFrames += MONO_BLOCK_SIZE;
 
 	// Pa_WriteStream(paOutputStream, blockStereo, MONO_BLOCK_SIZE);
 	if ((outputMode == OUTPUT_PASS_STAT) && (outputBuffer.readPos % BLOCKS_PER_STAT == 0)) {
@@ -111,6 +128,7 @@ int inputCallback(const sample_t *blockOrig, const sample_t *output, unsigned lo
 	for (size_t i = 0, j = 0; i < MONO_BLOCK_SIZE; i++, j += inputChannels) {
 		blockMono[i] = blockOrig[j];
 	}
+	inputFrames += MONO_BLOCK_SIZE;
 	if (inputMode != lastMode) {
 		__sync_synchronize();
 		switch (inputMode) {
@@ -125,6 +143,8 @@ int inputCallback(const sample_t *blockOrig, const sample_t *output, unsigned lo
 				if (lastMode != INPUT_SEND_MUTE) {
 					blockIndex = 0;
 					packet.clientID = clientID;
+					fecSenderReset(&uploadFec);
+					resamplerInit(&inputResampler, 1);
 				}
 				break;
 			default: break;
@@ -133,9 +153,34 @@ int inputCallback(const sample_t *blockOrig, const sample_t *output, unsigned lo
 	}
 	switch (inputMode) {
 		case INPUT_SEND:
-			packet.blockIndex = blockIndex++;
-			packet.playBlockIndex = outputBuffer.readPos;
-			send(udpSocket, (void *)&packet, sizeof(packet), 0);
+			// resampled to the server clock
+			resamplerPut(&inputResampler, blockMono, MONO_BLOCK_SIZE);
+			while (resamplerReady(&inputResampler, MONO_BLOCK_SIZE, 1 + inputDrift)) {
+				resamplerGet(&inputResampler, blockMono, MONO_BLOCK_SIZE, 1 + inputDrift);
+				packet.blockIndex = blockIndex++;
+				packet.inputFrames = inputFrames;
+				packet.playBlockIndex = outputBuffer.readPos;
+				packet.fecRequest = fecCopiesForLoss(sbufferLossRate(&outputBuffer));
+				packet.fecCopies = 0;
+				{
+					static struct packetClientData packetCoded = {};
+					struct packetClientData *packetSent = &packet;
+					size_t dataSize = sizeof(packet.block);
+					size_t codedSize = codecEncode(uploadCodec, blockMono, 1, packetCoded.data);
+					if (codedSize) {
+						memcpy(&packetCoded, &packet, offsetof(struct packetClientData, data));
+						packetCoded.codec = uploadCodec;
+						packetSent = &packetCoded;
+						dataSize = codedSize;
+					}
+					if (uploadFecCopies) {
+						fecSenderAdd(&uploadFec, blockMono, 1, packet.blockIndex);
+						packetSent->fecCopies = fecSenderPut(&uploadFec, 1, packet.blockIndex, uploadFecCopies, packetSent->data + dataSize);
+					}
+					send(udpSocket, (void *)packetSent,
+							offsetof(struct packetClientData, data) + dataSize + packetSent->fecCopies * CODEC_ADPCM_SIZE(1), 0);
+				}
+			}
 			break;
 		case INPUT_TO_OUTPUT:
 			{
@@ -191,6 +236,9 @@ reconnected:
 			case PACKET_HELO:
 				packetRaw[size] = '\0';
 				clientID = packet->sHelo.clientID;
+				uploadCodec = codecPreferred(packet->sHelo.codecs & codecs);
+				uploadFecCopies = 0;
+				driftReset(&outputDriftEstimator);
 				sbufferClear(&outputBuffer, packet->sHelo.initBlockIndex);
 				strncpy(sHeloStr, packet->sHelo.str, SHELO_STR_LEN+1);
 				sHeloStr[SHELO_STR_LEN]='\0';
@@ -209,10 +257,31 @@ reconnected:
 				inputMode = INPUT_SEND;
 				udpState = UDP_CONNECTED;
 				break;
-			case PACKET_DATA:
-				if ((udpState != UDP_CONNECTED) || (size != sizeof(struct packetServerData))) break;
-				sbufferWrite(&outputBuffer, packet->sData.blockIndex, packet->sData.block, false);
-				break;
+			case PACKET_DATA: {
+				if (udpState != UDP_CONNECTED) break;
+				size_t headerSize = offsetof(struct packetServerData, data);
+				if (size < headerSize) break;
+				ssize_t dataSize = fecDataSize(size, headerSize, packet->sData.fecCopies, 2);
+				if (dataSize < 0) break;
+				uploadFecCopies = packet->sData.fecRequest;
+				if (packet->sData.inputDrift) inputDrift = packet->sData.inputDrift; // kept until estimated again after reconnecting
+				driftAdd(&outputDriftEstimator, packet->sData.blockIndex * MONO_BLOCK_SIZE, outputFrames);
+				if (driftRate(&outputDriftEstimator)) outputDrift = driftRate(&outputDriftEstimator);
+				for (size_t i = 0; i < packet->sData.fecCopies; i++) {
+					sample_t block[STEREO_BLOCK_SIZE];
+					if (codecAdpcmDecode(packet->sData.data + dataSize + i * CODEC_ADPCM_SIZE(2), CODEC_ADPCM_SIZE(2), 2, block)) {
+						sbufferWriteRecovered(&outputBuffer, packet->sData.blockIndex - i - 1, block);
+					}
+				}
+				if (packet->sData.codec == CODEC_PCM) {
+					if (dataSize != sizeof(packet->sData.block)) break;
+					sbufferWrite(&outputBuffer, packet->sData.blockIndex, packet->sData.block, false);
+				} else {
+					sample_t block[STEREO_BLOCK_SIZE];
+					if (!codecDecode(packet->sData.codec, packet->sData.data, dataSize, 2, block)) break;
+					sbufferWrite(&outputBuffer, packet->sData.blockIndex, block, false);
+				}
+			} break;
 			case PACKET_STATUS:
 				if (udpState != UDP_CONNECTED) break;
 				packetRaw[size] = '\0';
@@ -240,6 +309,15 @@ reconnected:
 					ttyUpdateStatus(serverKeysDesc, ttyStatusLines);
 					ttyUpdateStatus(clientKeysDesc, ttyStatusLines);
 					ttyPrintStatus();
+					{
+						// the server sends only participant rows fitting the terminal
+						struct packetClientView packet = {
+							.type = PACKET_VIEW,
+							.clientID = clientID,
+							.height = ttyHeight()
+						};
+						send(udpSocket, (void *)&packet, sizeof(packet), 0);
+					}
 					if (inputMode != INPUT_SEND) {
 						struct packetClientNoop packet = {
 							.type = PACKET_NOOP,
@@ -265,6 +343,7 @@ reconnected:
 		Pa_Sleep(5000);
 		struct packetClientHelo packet = {
 			.type = PACKET_HELO,
+			.codecs = codecs,
 			.version = PROT_VERSION,
 			.aioLatency = aioLat,
 			.dBAdj = dBAdj
@@ -324,6 +403,7 @@ int main() {
 #endif
 	fflush(stdout);
 	sbufferClear(&outputBuffer, 0);
+	resamplerInit(&outputResampler, 2);
 	if (!aioConnectAudio(&paInputStream, &paOutputStream, false, (PaStreamCallback *) &inputCallback, (PaStreamCallback *) &outputCallback, &inputChannels)) {
 		printf("Cannot connect to any audio device.");
 		exit(2);
@@ -450,6 +530,17 @@ int main() {
 
 	strncpy(name, ttyPromptStr("Your name (without diacritics, at most " STR(NAME_LEN) " letters)"), NAME_LEN);
 	name[NAME_LEN]='\0';
+
+	printf(
+			"\n"
+			"Sound is compressed without loss of quality, which needs about\n"
+			"0.5 Mbps upload and 0.8 Mbps download depending on the sound;\n"
+			"on slow connections (DSL, mobile), lossy compression may help,\n"
+			"it needs 0.3 Mbps upload and 0.5 Mbps download.\n\n");
+	if (ttyPromptKey("Use lossy compression? [y/n]", "yn") == 'y') {
+		codecs = CODECS_SUPPORTED;
+	}
+
 	char *addr = NULL;
 
 	while (true) {
@@ -465,6 +556,7 @@ int main() {
 		{
 			struct packetClientHelo packet = {
 				.type = PACKET_HELO,
+				.codecs = codecs,
 				.version = PROT_VERSION,
 				.aioLatency = aioLat,
 				.dBAdj = dBAdj
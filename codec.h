@@ -0,0 +1,432 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   MONO_BLOCK_SIZE  (multiple of CODEC_PARTITION_SIZE)
+ *   sample_t         (int16_t)
+ */
+
+// Coding of single blocks of samples without any dependency between blocks.
+//
+// CODEC_LOSSLESS: each channel uses fixed linear predictor of order 0--3 (the best one for the block),
+// residuals are Rice coded in partitions having their own parameters;
+// stereo blocks may be coded as mid/side instead of left/right.
+//
+// CODEC_ADPCM: lossy IMA ADPCM, 4 bits per sample;
+// each channel starts with its own predictor state stored in the block header.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum codecType {
+	CODEC_PCM,
+	CODEC_LOSSLESS,
+	CODEC_ADPCM,
+	CODECS_CNT
+};
+#define CODECS_SUPPORTED ((1 << CODEC_PCM) | (1 << CODEC_LOSSLESS) | (1 << CODEC_ADPCM))
+#define CODECS_LOSSY     (1 << CODEC_ADPCM)
+
+// the last one in the enum order is preferred
+enum codecType codecPreferred(uint8_t codecs) {
+	enum codecType codec = CODEC_PCM;
+	for (int i = 0; i < CODECS_CNT; i++) {
+		if (codecs & CODECS_SUPPORTED & (1 << i)) codec = i;
+	}
+	return codec;
+}
+
+#define CODEC_PARTITION_SIZE  32  // samples sharing Rice parameter
+#define CODEC_MAX_ORDER        3
+#define CODEC_WARMUP_BITS     17  // side channel needs one more bit
+#define CODEC_RICE_BITS        5
+#define CODEC_RICE_MAX_K      20
+#define CODEC_ESCAPE          16  // greater quotients are replaced by raw values
+#define CODEC_ESCAPE_BITS     24
+
+// --- bit streams, most significant bit first ---
+
+struct codecWriter {
+	uint8_t *pos, *end;
+	uint64_t acc;
+	int bits;
+	bool overflow;
+};
+
+static inline void codecPutBytes(struct codecWriter *w) {
+	while (w->bits >= 8) {
+		w->bits -= 8;
+		if (w->pos < w->end) {
+			*w->pos++ = w->acc >> w->bits;
+		} else {
+			w->overflow = true;
+		}
+	}
+}
+
+static inline void codecPut(struct codecWriter *w, uint32_t value, int n) { // n <= 32
+	w->acc = (w->acc << n) | value;
+	w->bits += n;
+	if (w->bits >= 32) codecPutBytes(w);
+}
+
+// returns size in bytes or 0 on overflow
+static inline size_t codecPutEnd(struct codecWriter *w, uint8_t *start) {
+	if (w->bits & 7) codecPut(w, 0, 8 - (w->bits & 7));
+	codecPutBytes(w);
+	return w->overflow ? 0 : w->pos - start;
+}
+
+struct codecReader {
+	const uint8_t *pos, *end;
+	uint64_t acc;  // left aligned
+	int bits;
+	size_t overrun; // bytes read behind the end
+};
+
+static inline void codecRefill(struct codecReader *r) {
+	while (r->bits <= 56) {
+		uint64_t byte = 0;
+		if (r->pos < r->end) {
+			byte = *r->pos++;
+		} else {
+			r->overrun++;
+		}
+		r->acc |= byte << (56 - r->bits);
+		r->bits += 8;
+	}
+}
+
+static inline uint32_t codecGet(struct codecReader *r, int n) { // n <= 32
+	if (n == 0) return 0;
+	codecRefill(r);
+	uint32_t value = r->acc >> (64 - n);
+	r->acc <<= n;
+	r->bits -= n;
+	return value;
+}
+
+static inline bool codecReaderOk(struct codecReader *r) {
+	return r->overrun * 8 <= (size_t)r->bits; // only zero padding consumed
+}
+
+// --- lossless coding ---
+
+static inline uint32_t codecZigzag(int32_t v) {
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+static inline int32_t codecUnzigzag(uint32_t u) {
+	return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+}
+
+static inline int32_t codecPredict(const int32_t *x, size_t i, int order) {
+	switch (order) {
+		case 1:  return x[i-1];
+		case 2:  return 2 * x[i-1] - x[i-2];
+		case 3:  return 3 * (x[i-1] - x[i-2]) + x[i-3];
+		default: return 0;
+	}
+}
+
+static inline size_t codecRiceBits(uint32_t u, int k) {
+	uint32_t q = u >> k;
+	return q < CODEC_ESCAPE ? q + 1 + k : CODEC_ESCAPE + CODEC_ESCAPE_BITS;
+}
+
+static inline void codecPutRice(struct codecWriter *w, uint32_t u, int k) {
+	uint32_t q = u >> k;
+	if (q < CODEC_ESCAPE) {
+		codecPut(w, 1, q + 1);
+		if (k) codecPut(w, u & ((1u << k) - 1), k);
+	} else {
+		codecPut(w, 0, CODEC_ESCAPE);
+		codecPut(w, u, CODEC_ESCAPE_BITS);
+	}
+}
+
+static inline uint32_t codecGetRice(struct codecReader *r, int k) {
+	codecRefill(r);
+	int zeros = r->acc ? __builtin_clzll(r->acc) : 64;
+	if (zeros >= CODEC_ESCAPE) {
+		codecGet(r, CODEC_ESCAPE);
+		return codecGet(r, CODEC_ESCAPE_BITS);
+	}
+	r->acc <<= zeros + 1;
+	r->bits -= zeros + 1;
+	return ((uint32_t)zeros << k) | codecGet(r, k);
+}
+
+// sum of absolute residuals is used for choosing predictor order
+static inline int codecBestOrder(const int32_t *x, size_t n, uint64_t *costOut) {
+	uint64_t cost[CODEC_MAX_ORDER + 1] = {0};
+	for (size_t i = CODEC_MAX_ORDER; i < n; i++) {
+		int32_t e0 = x[i];
+		int32_t e1 = e0 - x[i-1];
+		int32_t e2 = e1 - (x[i-1] - x[i-2]);
+		int32_t e3 = e2 - (x[i-1] - 2 * x[i-2] + x[i-3]);
+		cost[0] += abs(e0);
+		cost[1] += abs(e1);
+		cost[2] += abs(e2);
+		cost[3] += abs(e3);
+	}
+	int order = 0;
+	for (int o = 1; o <= CODEC_MAX_ORDER; o++) {
+		if (cost[o] < cost[order]) order = o;
+	}
+	if (costOut) *costOut = cost[order];
+	return order;
+}
+
+void codecLosslessEncodeChannel(struct codecWriter *w, const int32_t *x) {
+	int order = codecBestOrder(x, MONO_BLOCK_SIZE, NULL);
+	codecPut(w, order, 2);
+	for (int i = 0; i < order; i++) {
+		codecPut(w, (uint32_t)x[i] & ((1u << CODEC_WARMUP_BITS) - 1), CODEC_WARMUP_BITS);
+	}
+
+	uint32_t u[MONO_BLOCK_SIZE];
+	for (size_t i = order; i < MONO_BLOCK_SIZE; i++) {
+		u[i] = codecZigzag(x[i] - codecPredict(x, i, order));
+	}
+
+	for (size_t p = 0; p < MONO_BLOCK_SIZE; p += CODEC_PARTITION_SIZE) {
+		size_t begin = p < (size_t)order ? order : p;
+		size_t end = p + CODEC_PARTITION_SIZE;
+		uint64_t sum = 0;
+		for (size_t i = begin; i < end; i++) sum += u[i];
+
+		// the parameter estimated from mean, its neighbours are tried too
+		int kEst = 0;
+		uint64_t mean = sum / (end - begin);
+		while ((kEst < CODEC_RICE_MAX_K) && ((1ull << (kEst + 1)) <= mean)) kEst++;
+		int k = kEst;
+		size_t bestBits = SIZE_MAX;
+		for (int k2 = kEst > 0 ? kEst - 1 : 0; (k2 <= kEst + 1) && (k2 <= CODEC_RICE_MAX_K); k2++) {
+			size_t bits = 0;
+			for (size_t i = begin; i < end; i++) bits += codecRiceBits(u[i], k2);
+			if (bits < bestBits) {
+				bestBits = bits;
+				k = k2;
+			}
+		}
+
+		codecPut(w, k, CODEC_RICE_BITS);
+		for (size_t i = begin; i < end; i++) {
+			codecPutRice(w, u[i], k);
+		}
+	}
+}
+
+// returns false on values out of the range of coded ones, which only malformed data could give
+bool codecLosslessDecodeChannel(struct codecReader *r, int32_t *x) {
+	int order = codecGet(r, 2);
+	for (int i = 0; i < order; i++) {
+		x[i] = (int32_t)(codecGet(r, CODEC_WARMUP_BITS) << (32 - CODEC_WARMUP_BITS)) >> (32 - CODEC_WARMUP_BITS);
+	}
+	for (size_t p = 0; p < MONO_BLOCK_SIZE; p += CODEC_PARTITION_SIZE) {
+		size_t begin = p < (size_t)order ? order : p;
+		size_t end = p + CODEC_PARTITION_SIZE;
+		int k = codecGet(r, CODEC_RICE_BITS);
+		if (k > CODEC_RICE_MAX_K) k = CODEC_RICE_MAX_K;
+		for (size_t i = begin; i < end; i++) {
+			int64_t v = (int64_t)codecUnzigzag(codecGetRice(r, k)) + codecPredict(x, i, order);
+			if ((v < -(1 << (CODEC_WARMUP_BITS - 1))) || (v >= (1 << (CODEC_WARMUP_BITS - 1)))) return false;
+			x[i] = v; // bounded, so that the following predictions cannot overflow
+		}
+	}
+	return true;
+}
+
+static inline sample_t codecClamp(int32_t v) {
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+}
+
+size_t codecLosslessEncode(const sample_t *block, size_t channels, uint8_t *out) {
+	struct codecWriter w = {
+		.pos = out,
+		.end = out + channels * MONO_BLOCK_SIZE * sizeof(sample_t)};
+	int32_t x[2][MONO_BLOCK_SIZE];
+
+	if (channels == 1) {
+		for (size_t i = 0; i < MONO_BLOCK_SIZE; i++) x[0][i] = block[i];
+		codecLosslessEncodeChannel(&w, x[0]);
+	} else {
+		int32_t ms[2][MONO_BLOCK_SIZE];
+		for (size_t i = 0; i < MONO_BLOCK_SIZE; i++) {
+			int32_t left = block[2 * i], right = block[2 * i + 1];
+			x[0][i] = left;
+			x[1][i] = right;
+			ms[0][i] = (left + right) >> 1;
+			ms[1][i] = left - right;
+		}
+		uint64_t costL, costR, costM, costS;
+		codecBestOrder(x[0],  MONO_BLOCK_SIZE, &costL);
+		codecBestOrder(x[1],  MONO_BLOCK_SIZE, &costR);
+		codecBestOrder(ms[0], MONO_BLOCK_SIZE, &costM);
+		codecBestOrder(ms[1], MONO_BLOCK_SIZE, &costS);
+		bool midSide = costM + costS < costL + costR;
+		codecPut(&w, midSide, 1);
+		codecLosslessEncodeChannel(&w, midSide ? ms[0] : x[0]);
+		codecLosslessEncodeChannel(&w, midSide ? ms[1] : x[1]);
+	}
+	return codecPutEnd(&w, out);
+}
+
+bool codecLosslessDecode(const uint8_t *in, size_t size, size_t channels, sample_t *block) {
+	struct codecReader r = {
+		.pos = in,
+		.end = in + size};
+	int32_t x[2][MONO_BLOCK_SIZE];
+
+	if (channels == 1) {
+		if (!codecLosslessDecodeChannel(&r, x[0])) return false;
+		for (size_t i = 0; i < MONO_BLOCK_SIZE; i++) block[i] = codecClamp(x[0][i]);
+	} else {
+		bool midSide = codecGet(&r, 1);
+		if (!codecLosslessDecodeChannel(&r, x[0]) || !codecLosslessDecodeChannel(&r, x[1])) return false;
+		if (midSide) {
+			for (size_t i = 0; i < MONO_BLOCK_SIZE; i++) {
+				int32_t mid = ((uint32_t)x[0][i] << 1) | (x[1][i] & 1), side = x[1][i];
+				block[2 * i]     = codecClamp((mid + side) >> 1);
+				block[2 * i + 1] = codecClamp((mid - side) >> 1);
+			}
+		} else {
+			for (size_t i = 0; i < MONO_BLOCK_SIZE; i++) {
+				block[2 * i]     = codecClamp(x[0][i]);
+				block[2 * i + 1] = codecClamp(x[1][i]);
+			}
+		}
+	}
+	return codecReaderOk(&r);
+}
+
+// --- IMA ADPCM ---
+
+#define CODEC_ADPCM_HEADER_SIZE 3 // per channel: initial predictor (16 b), step index (8 b)
+#define CODEC_ADPCM_SIZE(channels) ((channels) * (CODEC_ADPCM_HEADER_SIZE + MONO_BLOCK_SIZE / 2))
+
+static const int16_t codecAdpcmSteps[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+static const int8_t codecAdpcmIndexAdj[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+// branch-free, the encoder uses exactly the decoder's reconstruction
+static inline void codecAdpcmStep(int32_t *pred, int32_t *index, uint32_t code) {
+	int32_t step = codecAdpcmSteps[*index];
+	int32_t diff = step >> 3;
+	diff += step        & -(int32_t)((code >> 2) & 1);
+	diff += (step >> 1) & -(int32_t)((code >> 1) & 1);
+	diff += (step >> 2) & -(int32_t)(code & 1);
+	int32_t sign = -(int32_t)((code >> 3) & 1);
+	int32_t p = *pred + ((diff ^ sign) - sign);
+	*pred = p > INT16_MAX ? INT16_MAX : p < INT16_MIN ? INT16_MIN : p;
+	int32_t i = *index + codecAdpcmIndexAdj[code & 7];
+	*index = i < 0 ? 0 : i > 88 ? 88 : i;
+}
+
+// quantizes x and updates the state as the decoder will do
+static inline uint32_t codecAdpcmQuantize(int32_t *pred, int32_t *index, int32_t x) {
+	int32_t step = codecAdpcmSteps[*index];
+	int32_t diff = x - *pred;
+	int32_t sign = diff >> 31;
+	uint32_t code = sign & 8;
+	diff = (diff ^ sign) - sign;
+	int32_t vpdiff = step >> 3;
+	int32_t mask;
+	mask = -(int32_t)(diff >= step); code |= mask & 4; diff -= step & mask; vpdiff += step & mask; step >>= 1;
+	mask = -(int32_t)(diff >= step); code |= mask & 2; diff -= step & mask; vpdiff += step & mask; step >>= 1;
+	mask = -(int32_t)(diff >= step); code |= mask & 1;                      vpdiff += step & mask;
+	int32_t p = *pred + ((vpdiff ^ sign) - sign);
+	*pred = p > INT16_MAX ? INT16_MAX : p < INT16_MIN ? INT16_MIN : p;
+	int32_t i = *index + codecAdpcmIndexAdj[code & 7];
+	*index = i < 0 ? 0 : i > 88 ? 88 : i;
+	return code;
+}
+
+// initial step is estimated from differences at the beginning of the block
+static inline int32_t codecAdpcmInitIndex(const sample_t *block, size_t channels, size_t c) {
+	int32_t diffSum = 0;
+	for (size_t i = 1; i <= 8; i++) {
+		diffSum += abs(block[i * channels + c] - block[(i - 1) * channels + c]);
+	}
+	int32_t index = 0;
+	while ((index < 88) && (codecAdpcmSteps[index] < diffSum / 8)) index++;
+	return index;
+}
+
+static inline void codecAdpcmPutHeader(uint8_t *out, int32_t pred, int32_t index) {
+	out[0] = (uint16_t)pred & 0xff;
+	out[1] = (uint16_t)pred >> 8;
+	out[2] = index;
+}
+
+// channels of stereo blocks are coded in one loop to interleave their dependency chains
+size_t codecAdpcmEncode(const sample_t *block, size_t channels, uint8_t *out) {
+	uint8_t *data = out + channels * CODEC_ADPCM_HEADER_SIZE;
+	if (channels == 1) {
+		int32_t pred = block[0], index = codecAdpcmInitIndex(block, 1, 0);
+		codecAdpcmPutHeader(out, pred, index);
+		for (size_t i = 0; i < MONO_BLOCK_SIZE; i += 2) {
+			uint32_t code0 = codecAdpcmQuantize(&pred, &index, block[i]);
+			uint32_t code1 = codecAdpcmQuantize(&pred, &index, block[i + 1]);
+			*data++ = code0 | (code1 << 4);
+		}
+	} else {
+		int32_t predL = block[0], indexL = codecAdpcmInitIndex(block, 2, 0);
+		int32_t predR = block[1], indexR = codecAdpcmInitIndex(block, 2, 1);
+		codecAdpcmPutHeader(out, predL, indexL);
+		codecAdpcmPutHeader(out + CODEC_ADPCM_HEADER_SIZE, predR, indexR);
+		uint8_t *dataR = data + MONO_BLOCK_SIZE / 2;
+		for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 4) {
+			uint32_t codeL0 = codecAdpcmQuantize(&predL, &indexL, block[i]);
+			uint32_t codeR0 = codecAdpcmQuantize(&predR, &indexR, block[i + 1]);
+			uint32_t codeL1 = codecAdpcmQuantize(&predL, &indexL, block[i + 2]);
+			uint32_t codeR1 = codecAdpcmQuantize(&predR, &indexR, block[i + 3]);
+			*data++  = codeL0 | (codeL1 << 4);
+			*dataR++ = codeR0 | (codeR1 << 4);
+		}
+		data = dataR;
+	}
+	return data - out;
+}
+
+bool codecAdpcmDecode(const uint8_t *in, size_t size, size_t channels, sample_t *block) {
+	if (size != CODEC_ADPCM_SIZE(channels)) return false;
+	const uint8_t *data = in + channels * CODEC_ADPCM_HEADER_SIZE;
+	for (size_t c = 0; c < channels; c++) {
+		int32_t pred = (int16_t)(in[c * CODEC_ADPCM_HEADER_SIZE] | (in[c * CODEC_ADPCM_HEADER_SIZE + 1] << 8));
+		int32_t index = in[c * CODEC_ADPCM_HEADER_SIZE + 2];
+		if (index > 88) return false;
+		for (size_t i = 0; i < MONO_BLOCK_SIZE; i += 2) {
+			codecAdpcmStep(&pred, &index, *data & 15);
+			block[i * channels + c] = pred;
+			codecAdpcmStep(&pred, &index, *data++ >> 4);
+			block[(i + 1) * channels + c] = pred;
+		}
+	}
+	return true;
+}
+
+
+// block contains MONO_BLOCK_SIZE frames of channels interleaved samples (channels is 1 or 2);
+// returns size of coded data (at most size of the block) or 0 if the block should be sent uncoded
+size_t codecEncode(enum codecType codec, const sample_t *block, size_t channels, uint8_t *out) {
+	switch (codec) {
+		case CODEC_LOSSLESS: return codecLosslessEncode(block, channels, out);
+		case CODEC_ADPCM:    return codecAdpcmEncode(block, channels, out);
+		default:             return 0;
+	}
+}
+
+// returns false if the data are malformed
+bool codecDecode(enum codecType codec, const uint8_t *in, size_t size, size_t channels, sample_t *block) {
+	switch (codec) {
+		case CODEC_LOSSLESS: return codecLosslessDecode(in, size, channels, block);
+		case CODEC_ADPCM:    return codecAdpcmDecode(in, size, channels, block);
+		default:             return false;
+	}
+}
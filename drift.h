@@ -0,0 +1,165 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   DRIFT_MULTIPLIER
+ *   DRIFT_MIN_ARRIVALS
+ *   DRIFT_MAX
+ *   RESAMPLER_TAPS    (multiple of 4)
+ *   RESAMPLER_PHASES
+ *   MONO_BLOCK_SIZE
+ *   sample_t
+ */
+
+// Compensation of drift between sample clocks of sound cards and the server:
+// the rate of one clock relative to the other is estimated by exponentially weighted linear regression
+// of their positions at packet arrivals, the stream on the client side is then resampled
+// by polyphase windowed-sinc filter with linear interpolation between phases.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+// --- estimation ---
+
+struct driftEstimator {
+	uint32_t x0, y0;  // the first positions, others are relative to them
+	double meanX, meanY, varX, covXY;
+	size_t cnt;
+};
+
+void driftReset(struct driftEstimator *d) {
+	d->cnt = 0;
+}
+
+// adds positions (in frames) of the reference clock and of the measured one at the same moment
+void driftAdd(struct driftEstimator *d, uint32_t x, uint32_t y) {
+	if (!d->cnt) {
+		d->x0 = x;
+		d->y0 = y;
+		d->meanX = d->meanY = d->varX = d->covXY = 0;
+	}
+	int32_t dx = x - d->x0, dy = y - d->y0;
+	if ((dx > (1 << 30)) || (dx < -(1 << 30))) {
+		// rebase to prevent overflow
+		d->x0 += dx;
+		d->y0 += dy;
+		d->meanX -= dx;
+		d->meanY -= dy;
+		dx = dy = 0;
+	}
+	double a = (d->cnt * (1 - DRIFT_MULTIPLIER) < 1 ? 1.0 / (d->cnt + 1) : 1 - DRIFT_MULTIPLIER);
+	double ex = dx - d->meanX, ey = dy - d->meanY;
+	d->meanX += a * ex;
+	d->meanY += a * ey;
+	d->varX = (1 - a) * (d->varX + a * ex * ex);
+	d->covXY = (1 - a) * (d->covXY + a * ex * ey);
+	d->cnt++;
+}
+
+// relative rate of the measured clock minus one, 0 if not known yet
+float driftRate(struct driftEstimator *d) {
+	if ((d->cnt < DRIFT_MIN_ARRIVALS) || (d->varX <= 0)) return 0;
+	double rate = d->covXY / d->varX - 1;
+	if (rate > DRIFT_MAX) rate = DRIFT_MAX;
+	if (rate < -DRIFT_MAX) rate = -DRIFT_MAX;
+	return rate;
+}
+
+
+// --- resampling ---
+
+#define RESAMPLER_FRAMES (4 * MONO_BLOCK_SIZE + RESAMPLER_TAPS)  // max input frames kept
+
+// coefficients of each phase, with the first one of the next phase appended for interpolation
+float resamplerCoefs[RESAMPLER_PHASES + 1][RESAMPLER_TAPS] __attribute__((aligned(32)));
+bool resamplerCoefsReady = false;
+
+struct resampler {
+	float in[2][RESAMPLER_FRAMES] __attribute__((aligned(32))); // input frames by channel
+	size_t inCnt;
+	double pos;   // position of the next output frame within the input, minus RESAMPLER_TAPS / 2 - 1
+	int channels;
+};
+
+void resamplerInitCoefs() {
+	if (resamplerCoefsReady) return;
+	const double cutoff = 0.9; // of Nyquist frequency; the ratio is close to 1
+	for (int p = 0; p <= RESAMPLER_PHASES; p++) {
+		double sum = 0;
+		for (int i = 0; i < RESAMPLER_TAPS; i++) {
+			double t = i - (RESAMPLER_TAPS / 2 - 1) - (double)p / RESAMPLER_PHASES; // distance from the output frame
+			double sinc = (t == 0 ? 1 : sin(M_PI * cutoff * t) / (M_PI * cutoff * t));
+			double w = (t + RESAMPLER_TAPS / 2) / RESAMPLER_TAPS; // Blackman window
+			w = (w <= 0 || w >= 1 ? 0 : 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w));
+			resamplerCoefs[p][i] = sinc * w;
+			sum += sinc * w;
+		}
+		for (int i = 0; i < RESAMPLER_TAPS; i++) {
+			resamplerCoefs[p][i] /= sum;
+		}
+	}
+	resamplerCoefsReady = true;
+}
+
+void resamplerInit(struct resampler *r, int channels) {
+	resamplerInitCoefs();
+	memset(r->in, 0, sizeof(r->in));
+	r->inCnt = RESAMPLER_TAPS - 1; // silence preceding the stream
+	r->pos = 0;
+	r->channels = channels;
+}
+
+// appends interleaved input frames, returns false if there is no space
+bool resamplerPut(struct resampler *r, const sample_t *in, size_t frames) {
+	if (r->inCnt + frames > RESAMPLER_FRAMES) return false;
+	for (int c = 0; c < r->channels; c++) {
+		float *dst = r->in[c] + r->inCnt;
+		for (size_t i = 0; i < frames; i++) {
+			dst[i] = in[i * r->channels + c];
+		}
+	}
+	r->inCnt += frames;
+	return true;
+}
+
+// whether there are enough input frames to get the given number of output frames
+bool resamplerReady(struct resampler *r, size_t frames, double step) {
+	return (size_t)(r->pos + (frames - 1) * step) + RESAMPLER_TAPS <= r->inCnt;
+}
+
+// writes interleaved output frames, each step input frames apart; the resampler has to be ready for them
+void resamplerGet(struct resampler *r, sample_t *out, size_t frames, double step) {
+	for (size_t i = 0; i < frames; i++) {
+		size_t first = r->pos;
+		double phase = (r->pos - first) * RESAMPLER_PHASES;
+		int p = phase;
+		float f = phase - p;
+		const float *h0 = resamplerCoefs[p], *h1 = resamplerCoefs[p + 1];
+		for (int c = 0; c < r->channels; c++) {
+			const float *x = r->in[c] + first;
+			float sum0[4] = {0}, sum1[4] = {0}; // independent lanes, so that the loop can be vectorized
+			for (int k = 0; k < RESAMPLER_TAPS; k += 4) {
+				for (int j = 0; j < 4; j++) {
+					sum0[j] += x[k + j] * h0[k + j];
+					sum1[j] += x[k + j] * h1[k + j];
+				}
+			}
+			float s0 = (sum0[0] + sum0[1]) + (sum0[2] + sum0[3]);
+			float s1 = (sum1[0] + sum1[1]) + (sum1[2] + sum1[3]);
+			float val = s0 + (s1 - s0) * f;
+			out[i * r->channels + c] = (val > INT16_MAX ? INT16_MAX : val < INT16_MIN ? INT16_MIN : lrintf(val));
+		}
+		r->pos += step;
+	}
+
+	// drop consumed input
+	size_t consumed = r->pos;
+	if (consumed) {
+		for (int c = 0; c < r->channels; c++) {
+			memmove(r->in[c], r->in[c] + consumed, (r->inCnt - consumed) * sizeof(float));
+		}
+		r->inCnt -= consumed;
+		r->pos -= consumed;
+	}
+}
@@ -0,0 +1,69 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   FEC_MAX_COPIES
+ *   MONO_BLOCK_SIZE
+ *   bindex_t
+ *   sample_t
+ */
+
+// Forward error correction: data packets can carry ADPCM copies of up to FEC_MAX_COPIES preceding blocks
+// directly after their own (possibly coded) data; the receiver requests their count according to its loss rate
+// and writes the copies of blocks it is missing to its buffer.
+
+#include <stdint.h>
+#include <string.h>
+
+struct fecSender {
+	uint8_t copies[FEC_MAX_COPIES + 1][CODEC_ADPCM_SIZE(2)]; // indexed by block index
+	bindex_t blockIndex[FEC_MAX_COPIES + 1];                 // of the stored copies
+	bool valid[FEC_MAX_COPIES + 1];
+};
+
+// number of copies to be requested by a receiver with the given rate of lost and recovered blocks
+int fecCopiesForLoss(float loss) {
+	int copies;
+	if (loss < 0.001) {
+		copies = 0;
+	} else if (loss < 0.01) {
+		copies = 1;
+	} else if (loss < 0.03) {
+		copies = 2;
+	} else {
+		copies = 3;
+	}
+	return copies < FEC_MAX_COPIES ? copies : FEC_MAX_COPIES;
+}
+
+void fecSenderReset(struct fecSender *fec) {
+	for (size_t i = 0; i <= FEC_MAX_COPIES; i++) {
+		fec->valid[i] = false;
+	}
+}
+
+// stores copy of a sent block, to be called for consecutive blocks while copies are requested
+void fecSenderAdd(struct fecSender *fec, const sample_t *block, size_t channels, bindex_t blockIndex) {
+	size_t i = blockIndex % (FEC_MAX_COPIES + 1);
+	codecAdpcmEncode(block, channels, fec->copies[i]);
+	fec->blockIndex[i] = blockIndex;
+	fec->valid[i] = true;
+}
+
+// writes copies of blocks preceding blockIndex to out, returns their number
+size_t fecSenderPut(struct fecSender *fec, size_t channels, bindex_t blockIndex, size_t copies, uint8_t *out) {
+	if (copies > FEC_MAX_COPIES) copies = FEC_MAX_COPIES;
+	size_t cnt = 0;
+	for (; cnt < copies; cnt++) {
+		bindex_t index = blockIndex - cnt - 1;
+		size_t i = index % (FEC_MAX_COPIES + 1);
+		if (!fec->valid[i] || (fec->blockIndex[i] != index)) break;
+		memcpy(out + cnt * CODEC_ADPCM_SIZE(channels), fec->copies[i], CODEC_ADPCM_SIZE(channels));
+	}
+	return cnt;
+}
+
+// size of data of a received packet without copies, or -1 if malformed
+ssize_t fecDataSize(size_t size, size_t headerSize, size_t copies, size_t channels) {
+	if ((copies > FEC_MAX_COPIES) || (size < headerSize + copies * CODEC_ADPCM_SIZE(channels))) return -1;
+	return size - headerSize - copies * CODEC_ADPCM_SIZE(channels);
+}
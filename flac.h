@@ -0,0 +1,328 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   sample_t  (16 bits)
+ */
+
+// Lossless compression to FLAC: frames of fixed size, subframes with fixed polynomial predictors
+// and Rice-coded residuals partitioned adaptively, stereo decorrelated by the cheapest of left/side, side/right and mid/side.
+// The stream header contains a seek table of reserved size, to be rewritten when the stream is finished.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define FLAC_BLOCK_SIZE      4096  // samples per channel in a frame
+#define FLAC_MAX_PARTITION_ORDER 6
+#define FLAC_MAX_RICE_PARAM    14
+#define FLAC_MAX_FRAME_SIZE(CHANNELS) (32 + (CHANNELS) * (FLAC_BLOCK_SIZE * 17 / 8 + 8))  // verbatim with side channel
+#define FLAC_HEADER_SIZE(SEEK_POINTS, ALIGN) ((4 + 4 + 34 + 4 + 18 * (SEEK_POINTS) + 4 + (ALIGN) - 1) / (ALIGN) * (ALIGN))  // padded
+
+struct flacSeekPoint {
+	uint64_t sample;
+	uint64_t offset; // of the frame from the first one
+	uint16_t samples;
+};
+
+// --- bit writing ---
+
+struct flacBits {
+	uint8_t *out;
+	size_t pos;   // bytes written
+	uint64_t acc;
+	int accBits;
+};
+
+static inline void flacPut(struct flacBits *b, uint32_t value, int bits) {
+	b->acc = (b->acc << bits) | (value & (bits == 32 ? UINT32_MAX : ((1u << bits) - 1)));
+	b->accBits += bits;
+	while (b->accBits >= 8) {
+		b->accBits -= 8;
+		b->out[b->pos++] = b->acc >> b->accBits;
+	}
+}
+
+static inline void flacPutZeros(struct flacBits *b, uint32_t cnt) {
+	for (; cnt > 24; cnt -= 24) flacPut(b, 0, 24);
+	flacPut(b, 0, cnt);
+}
+
+static inline void flacAlign(struct flacBits *b) {
+	if (b->accBits) flacPut(b, 0, 8 - b->accBits);
+}
+
+static uint8_t flacCrc8(const uint8_t *data, size_t len) {
+	uint8_t crc = 0;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (int j = 0; j < 8; j++) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+static uint16_t flacCrc16Table[256];
+static bool flacCrc16TableReady = false;
+
+static uint16_t flacCrc16(const uint8_t *data, size_t len) {
+	if (!flacCrc16TableReady) { // idempotent, so it can be done by more threads at once
+		for (int i = 0; i < 256; i++) {
+			uint16_t crc = i << 8;
+			for (int j = 0; j < 8; j++) crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+			flacCrc16Table[i] = crc;
+		}
+		__sync_synchronize();
+		flacCrc16TableReady = true;
+	}
+	uint16_t crc = 0;
+	for (size_t i = 0; i < len; i++) crc = (crc << 8) ^ flacCrc16Table[(crc >> 8) ^ data[i]];
+	return crc;
+}
+
+// --- subframes ---
+
+static void flacResidual(const int32_t *x, size_t cnt, int order, int32_t *res) {
+	for (size_t i = order; i < cnt; i++) {
+		switch (order) {
+			case 0: res[i] = x[i]; break;
+			case 1: res[i] = x[i] - x[i-1]; break;
+			case 2: res[i] = x[i] - 2 * x[i-1] + x[i-2]; break;
+			case 3: res[i] = x[i] - 3 * x[i-1] + 3 * x[i-2] - x[i-3]; break;
+			case 4: res[i] = x[i] - 4 * x[i-1] + 6 * x[i-2] - 4 * x[i-3] + x[i-4]; break;
+		}
+	}
+}
+
+// the best Rice parameter and number of bits of a partition with the given sum of zigzag-coded residuals
+static inline uint64_t flacRiceBits(uint64_t sum, size_t cnt, int *param) {
+	uint64_t best = UINT64_MAX;
+	for (int k = 0; k <= FLAC_MAX_RICE_PARAM; k++) {
+		uint64_t bits = (uint64_t)cnt * (k + 1) + (sum >> k);
+		if (bits < best) {
+			best = bits;
+			*param = k;
+		}
+	}
+	return best;
+}
+
+struct flacSubframe {
+	int type; // 0 constant, 1 verbatim, 2 fixed
+	int order;
+	int partitionOrder;
+	int params[1 << FLAC_MAX_PARTITION_ORDER];
+	uint64_t bits;
+};
+
+// chooses the cheapest coding of the channel; res is a temporary buffer
+static void flacAnalyze(const int32_t *x, size_t cnt, int bps, uint32_t *res, struct flacSubframe *sf) {
+	sf->type = 0;
+	sf->bits = 8 + bps;
+	bool constant = true;
+	for (size_t i = 1; i < cnt; i++) {
+		if (x[i] != x[0]) {
+			constant = false;
+			break;
+		}
+	}
+	if (constant) return;
+
+	sf->type = 1;
+	sf->bits = 8 + (uint64_t)cnt * bps;
+	if (cnt <= 4) return;
+
+	// the order with the least sum of absolute residuals
+	uint64_t sums[5] = {0};
+	for (size_t i = 4; i < cnt; i++) {
+		int64_t e0 = x[i], e1 = e0 - x[i-1], e2 = e1 - (x[i-1] - x[i-2]);
+		int64_t e3 = e2 - (x[i-1] - 2 * x[i-2] + x[i-3]);
+		int64_t e4 = e3 - (x[i-1] - 3 * x[i-2] + 3 * x[i-3] - x[i-4]);
+		sums[0] += e0 < 0 ? -e0 : e0;
+		sums[1] += e1 < 0 ? -e1 : e1;
+		sums[2] += e2 < 0 ? -e2 : e2;
+		sums[3] += e3 < 0 ? -e3 : e3;
+		sums[4] += e4 < 0 ? -e4 : e4;
+	}
+	int order = 0;
+	for (int o = 1; o <= 4; o++) {
+		if (sums[o] < sums[order]) order = o;
+	}
+
+	flacResidual(x, cnt, order, (int32_t *)res);
+	for (size_t i = order; i < cnt; i++) {
+		int32_t e = res[i];
+		res[i] = ((uint32_t)e << 1) ^ (uint32_t)(e >> 31);
+	}
+
+	// sums of partitions of the highest order, merged for the lower ones
+	int maxPartitionOrder = 0;
+	while ((maxPartitionOrder < FLAC_MAX_PARTITION_ORDER) && !(cnt & ((2u << maxPartitionOrder) - 1)) &&
+			((cnt >> (maxPartitionOrder + 1)) > (size_t)order)) {
+		maxPartitionOrder++;
+	}
+	uint64_t partSums[1 << FLAC_MAX_PARTITION_ORDER];
+	size_t partSize = cnt >> maxPartitionOrder;
+	for (size_t p = 0; p < (1u << maxPartitionOrder); p++) {
+		uint64_t sum = 0;
+		for (size_t i = (p == 0 ? order : p * partSize); i < (p + 1) * partSize; i++) sum += res[i];
+		partSums[p] = sum;
+	}
+	uint64_t bestBits = UINT64_MAX;
+	for (int po = maxPartitionOrder; po >= 0; po--) {
+		if (po < maxPartitionOrder) {
+			for (size_t p = 0; p < (1u << po); p++) partSums[p] = partSums[2 * p] + partSums[2 * p + 1];
+		}
+		int params[1 << FLAC_MAX_PARTITION_ORDER];
+		uint64_t bits = 8 + order * bps + 6;
+		for (size_t p = 0; p < (1u << po); p++) {
+			size_t n = (cnt >> po) - (p == 0 ? order : 0);
+			bits += 4 + flacRiceBits(partSums[p], n, &params[p]);
+		}
+		if (bits < bestBits) {
+			bestBits = bits;
+			sf->partitionOrder = po;
+			memcpy(sf->params, params, (1u << po) * sizeof(int));
+		}
+	}
+	if (bestBits < sf->bits) {
+		sf->type = 2;
+		sf->order = order;
+		sf->bits = bestBits;
+	}
+}
+
+// res has to contain the residuals left by flacAnalyze
+static void flacWriteSubframe(struct flacBits *b, const int32_t *x, size_t cnt, int bps, const uint32_t *res, const struct flacSubframe *sf) {
+	switch (sf->type) {
+		case 0:
+			flacPut(b, 0x00, 8);
+			flacPut(b, x[0], bps);
+			break;
+		case 1:
+			flacPut(b, 0x02, 8);
+			for (size_t i = 0; i < cnt; i++) flacPut(b, x[i], bps);
+			break;
+		case 2:
+			flacPut(b, 0x10 | (sf->order << 1), 8);
+			for (int i = 0; i < sf->order; i++) flacPut(b, x[i], bps);
+			flacPut(b, 0, 2); // Rice coding with 4-bit parameters
+			flacPut(b, sf->partitionOrder, 4);
+			size_t partSize = cnt >> sf->partitionOrder;
+			for (size_t p = 0; p < (1u << sf->partitionOrder); p++) {
+				int k = sf->params[p];
+				flacPut(b, k, 4);
+				for (size_t i = (p == 0 ? sf->order : p * partSize); i < (p + 1) * partSize; i++) {
+					flacPutZeros(b, res[i] >> k);
+					flacPut(b, 1, 1);
+					flacPut(b, res[i], k);
+				}
+			}
+			break;
+	}
+}
+
+// --- interface ---
+
+// encodes a frame of cnt (at most FLAC_BLOCK_SIZE) interleaved samples of each of one or two channels, returns its size;
+// out has to have FLAC_MAX_FRAME_SIZE(channels) bytes
+size_t flacEncodeFrame(uint8_t *out, const sample_t *samples, int channels, size_t cnt, uint64_t frameNumber, int sampleRate) {
+	int32_t x[4][FLAC_BLOCK_SIZE]; // left, right, mid, side; or just the only channel
+	uint32_t res[4][FLAC_BLOCK_SIZE];
+	struct flacSubframe sf[4];
+	int bps[4] = {16, 16, 16, 17};
+
+	for (int c = 0; c < channels; c++) {
+		for (size_t i = 0; i < cnt; i++) x[c][i] = samples[i * channels + c];
+	}
+	int assignment = channels - 1; // independent
+	int coded[2] = {0, 1}; // indices of the channels written
+	if (channels == 2) {
+		for (size_t i = 0; i < cnt; i++) {
+			x[2][i] = (x[0][i] + x[1][i]) >> 1;
+			x[3][i] = x[0][i] - x[1][i];
+		}
+		for (int c = 0; c < 4; c++) flacAnalyze(x[c], cnt, bps[c], res[c], &sf[c]);
+		uint64_t bits[4] = {sf[0].bits + sf[1].bits, sf[0].bits + sf[3].bits, sf[3].bits + sf[1].bits, sf[2].bits + sf[3].bits};
+		const int assignments[4] = {1, 8, 9, 10};
+		const int codedPairs[4][2] = {{0, 1}, {0, 3}, {3, 1}, {2, 3}};
+		int best = 0;
+		for (int i = 1; i < 4; i++) {
+			if (bits[i] < bits[best]) best = i;
+		}
+		assignment = assignments[best];
+		coded[0] = codedPairs[best][0];
+		coded[1] = codedPairs[best][1];
+	} else {
+		flacAnalyze(x[0], cnt, 16, res[0], &sf[0]);
+	}
+
+	struct flacBits b = {.out = out};
+	flacPut(&b, 0xfff8, 16); // sync code, fixed block size
+	int sizeCode = cnt == FLAC_BLOCK_SIZE ? 12 : 7;
+	int rateCode = sampleRate == 44100 ? 9 : sampleRate == 48000 ? 10 : sampleRate == 96000 ? 11 : 0;
+	flacPut(&b, sizeCode, 4);
+	flacPut(&b, rateCode, 4);
+	flacPut(&b, assignment, 4);
+	flacPut(&b, 4, 3); // 16 bits per sample
+	flacPut(&b, 0, 1);
+	// frame number coded like UTF-8
+	if (frameNumber < 0x80) {
+		flacPut(&b, frameNumber, 8);
+	} else {
+		int bytes = 2;
+		while ((bytes < 7) && (frameNumber >= (1ull << (5 * bytes + 1)))) bytes++;
+		flacPut(&b, (0xff00 >> bytes) | (frameNumber >> (6 * (bytes - 1))), 8);
+		for (int i = bytes - 2; i >= 0; i--) flacPut(&b, 0x80 | ((frameNumber >> (6 * i)) & 0x3f), 8);
+	}
+	if (sizeCode == 7) flacPut(&b, cnt - 1, 16);
+	flacPut(&b, flacCrc8(b.out, b.pos), 8);
+
+	for (int c = 0; c < channels; c++) {
+		int i = coded[c];
+		flacWriteSubframe(&b, x[i], cnt, bps[i], res[i], &sf[i]);
+	}
+	flacAlign(&b);
+	uint16_t crc = flacCrc16(b.out, b.pos);
+	flacPut(&b, crc, 16);
+	return b.pos;
+}
+
+// writes the stream header of FLAC_HEADER_SIZE bytes; unused seek points are left as placeholders
+void flacHeader(uint8_t *out, int channels, int sampleRate, uint64_t totalSamples,
+		const struct flacSeekPoint *seekPoints, size_t seekPointsCnt, size_t maxSeekPoints, size_t align) {
+	size_t size = FLAC_HEADER_SIZE(maxSeekPoints, align);
+	memset(out, 0, size);
+	struct flacBits b = {.out = out};
+	flacPut(&b, 'f', 8); flacPut(&b, 'L', 8); flacPut(&b, 'a', 8); flacPut(&b, 'C', 8);
+
+	flacPut(&b, 0, 8); // STREAMINFO
+	flacPut(&b, 34, 24);
+	flacPut(&b, FLAC_BLOCK_SIZE, 16);
+	flacPut(&b, FLAC_BLOCK_SIZE, 16);
+	flacPut(&b, 0, 24); // frame sizes unknown
+	flacPut(&b, 0, 24);
+	flacPut(&b, sampleRate, 20);
+	flacPut(&b, channels - 1, 3);
+	flacPut(&b, 15, 5);
+	flacPut(&b, totalSamples >> 32, 4);
+	flacPut(&b, totalSamples, 32);
+	b.pos += 16; // MD5 unknown
+
+	flacPut(&b, 3, 8); // SEEKTABLE
+	flacPut(&b, 18 * maxSeekPoints, 24);
+	for (size_t i = 0; i < maxSeekPoints; i++) {
+		if (i < seekPointsCnt) {
+			flacPut(&b, seekPoints[i].sample >> 32, 32);
+			flacPut(&b, seekPoints[i].sample, 32);
+			flacPut(&b, seekPoints[i].offset >> 32, 32);
+			flacPut(&b, seekPoints[i].offset, 32);
+			flacPut(&b, seekPoints[i].samples, 16);
+		} else {
+			flacPut(&b, UINT32_MAX, 32);
+			flacPut(&b, UINT32_MAX, 32);
+			b.pos += 10;
+		}
+	}
+
+	flacPut(&b, 0x81, 8); // the last one, PADDING
+	flacPut(&b, size - b.pos - 3, 24);
+}
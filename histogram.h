@@ -0,0 +1,87 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   HISTOGRAM_SUB_BITS
+ *   HISTOGRAM_MAX_BITS
+ */
+
+// HDR-like histograms of durations (in ns): a value is counted in the bucket given by its highest set bit
+// and the HISTOGRAM_SUB_BITS following ones, so the relative error of reported values is below 2^-HISTOGRAM_SUB_BITS.
+// Each histogram has a single writer and holds cumulative counts;
+// readers merge histograms of more threads and subtract a previous snapshot to get counts of an interval.
+
+#include <stdint.h>
+#include <time.h>
+
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t sum; // of all values
+};
+
+static inline uint64_t histogramNsec() {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+static inline size_t histogramBucket(uint64_t value) {
+	if (value >= (1ull << HISTOGRAM_MAX_BITS)) value = (1ull << HISTOGRAM_MAX_BITS) - 1;
+	if (value < HISTOGRAM_SUB_BUCKETS) return value;
+	int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+// the largest value counted in the bucket
+static inline uint64_t histogramBucketMax(size_t bucket) {
+	if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+	int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	return ((bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+// to be called only by the owner of the histogram, negative values are counted as zero
+static inline void histogramAdd(struct histogram *h, int64_t value) {
+	if (value < 0) value = 0;
+	h->counts[histogramBucket(value)]++;
+	h->sum += value;
+}
+
+// adds counts of src to dst
+void histogramMerge(struct histogram *dst, const struct histogram *src) {
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		dst->counts[i] += src->counts[i];
+	}
+	dst->sum += src->sum;
+}
+
+// subtracts counts of an older snapshot
+void histogramSubtract(struct histogram *dst, const struct histogram *prev) {
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		dst->counts[i] -= prev->counts[i];
+	}
+	dst->sum -= prev->sum;
+}
+
+uint64_t histogramCount(const struct histogram *h) {
+	uint64_t cnt = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		cnt += h->counts[i];
+	}
+	return cnt;
+}
+
+// upper bound of the given quantile (0--1), 1 gives the max; 0 if empty
+uint64_t histogramQuantile(const struct histogram *h, double quantile) {
+	uint64_t cnt = histogramCount(h);
+	if (!cnt) return 0;
+	uint64_t rank = quantile * cnt;
+	if (rank >= cnt) rank = cnt - 1;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		sum += h->counts[i];
+		if (sum > rank) return histogramBucketMax(i);
+	}
+	return histogramBucketMax(HISTOGRAM_BUCKETS - 1);
+}
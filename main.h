@@ -2,25 +2,75 @@
 
 #define _GNU_SOURCE
 
-#define PROT_VERSION              4
+#define PROT_VERSION              5  // raised once for all packet layout changes since release 1.4, older clients are refused
 #define APP_VERSION             1.4
 #define UDP_PORT              64199
 #define NAME_LEN                 10
-#define MAX_CLIENTS             100
+#define MAX_CLIENTS             512
 #define BLOCKS_PER_STAT          50
 #define BLOCKS_PER_SRV_STAT    2000  // should be divisible by BLOCKS_PER_STAT
 #define CONN_TIMEOUT_MSEC      2000  // ms
 
 #define CLIENT_SOCK_BUF_SIZE 100000 // B
 // #define SERVER_SCHED_DEADLINE
+#define SERVER_RECV_THREADS       1  // more sockets are opened on UDP_PORT with SO_REUSEPORT, each with its own thread
+// #define SERVER_RECV_STEER_CPU      // assign datagrams to the sockets by receiving cpu instead of by address hash
+#define SERVER_RECV_HANDOVER_BLOCKS 8  // client not received by its receiver thread for this time is taken over by another one
+#define SERVER_MIXER_CPU         -1  // cpu the sound mixer is pinned to, -1 = no pinning
+#define SERVER_RECV_CPU          -1  // first cpu of receivers, each is pinned to the next one; -1 = no pinning
+#define SERVER_STATUS_CPU        -1  // cpu of the status thread, -1 = no pinning
+#define SERVER_BUSY_POLL_USEC     0  // the mixer polls the clock instead of sleeping for the last part of each wait
+#define SERVER_MAX_CATCHUP_BLOCKS 8  // missed ticks processed back to back, more of them are dropped from the timeline
+#define SERVER_METRICS_PORT   64199  // loopback TCP port with metrics in Prometheus text format, 0 = disabled
 
 #define SAMPLE_RATE           48000
 #define MONO_BLOCK_SIZE         128  // 2.667 ms
-#define BUFFER_BLOCKS          4096  // 10.92 s, ~1 MB mono, ~2 MB stereo
+#define BUFFER_BLOCKS          4096  // 10.92 s, maximal delay in buffer
+#define BUFFER_PAGE_BLOCKS       32  // 85 ms, ~8 kB mono, ~16 kB stereo; buffers hold only pages around their delay
+#define BUFFER_POOL_PAGES       128  // pages allocated at once for the pool shared by buffers
+#define BUFFER_POOL_MAX_CHUNKS  128  // max number of such allocations
 #define STEREO_BLOCK_SIZE (2 * MONO_BLOCK_SIZE)
-#define BUFFER_DES_JUMP_PERIOD 1500  // blocks, 4s; desired minimal period between jumps in stream
+#define BUFFER_LATE_TARGET    0.005  // fraction of blocks allowed to arrive too late, delay is lowered to the quantile of their lateness
+#define BUFFER_JITTER_BINS      256  // blocks, 0.68 s; max distinguished lateness
+#define BUFFER_JITTER_MULTIPLIER  0.9995
+	// multiplies weights of previous arrivals every arrived block, they are halved after ~4 s
+#define BUFFER_SLACK_PERIOD      32  // blocks, 85 ms; arrivals between updates of the playout target
 
 #define BUFFER_SKIP_PERIOD       20  // blocks, 53 ms
+#define BUFFER_TSM_MAX_BLOCKS    32  // blocks, 85 ms; larger excess of delay is skipped, smaller one is drained by splicing similar segments
+#define BUFFER_TSM_RATE        0.04  // max rate of shortening or lengthening the stream by splicing
+#define BUFFER_TSM_MAX_LAG      480  // samples, 100 Hz; max length of a spliced segment
+#define BUFFER_PLC_BLOCKS         8  // blocks, 21 ms; missing sound is concealed by repeating its pitch period, then faded out
+#define BUFFER_PLC_HISTORY_BLOCKS 8  // blocks searched for the pitch period
+#define BUFFER_PLC_MIN_PERIOD    40  // samples, 1200 Hz
+#define BUFFER_PLC_MAX_PERIOD   640  // samples, 75 Hz; shorter than the history by at least two blocks
+
+#define FEC_MAX_COPIES            3  // lossy copies of preceding blocks added to data packets on losses, 0 disables
+#define FEC_LOSS_MULTIPLIER       0.9991
+	// multiplies avg loss rate every played block, it's halved after ~2 s
+
+#define DRIFT_MULTIPLIER          0.99997
+	// multiplies weights of previous arrivals in drift estimation every arrived block, they are halved after ~1 min
+#define DRIFT_MIN_ARRIVALS     7500  // blocks, 20 s; no drift is assumed before
+#define DRIFT_MAX                 0.002  // max relative difference of sample clocks compensated
+#define RESAMPLER_TAPS           32
+#define RESAMPLER_PHASES        128
+
+#define RECORDER_RING_SIZE (32 << 20)  // B, ~3 s of 100 tracks; recorded data waiting for the writer thread, more are dropped
+#define RECORDER_WRITE_BLOCKS   512  // 1.37 s, 128 kB mono; blocks of a track written at once
+#define RECORDER_GAP_MAX_BLOCKS 375  // 1 s; longer absence of blocks of a track ends it, shorter one is filled with silence
+#define RECORDER_MAX_TRACKS (MAX_CLIENTS + 2)
+#define RECORDER_FLAC             1  // compressed losslessly, otherwise WAV
+#define RECORDER_SEEK_POINTS   2048  // reserved in FLAC header, one per written chunk (~47 min), thinned later
+#define RECORDER_THREADS          2  // compressing recordings with the lowest priority, incl. writer thread
+#define BACKING_AHEAD_BLOCKS    750  // 2 s, 400 kB; backing track read from the file in advance
+
+#define MIXER_THREADS             0  // 0 = number of online CPUs
+#define MIXER_CLIENTS_PER_THREAD 16  // more threads are woken up only for larger rooms
+#define WORKER_POOL_MAX_THREADS  16
+
+#define HISTOGRAM_SUB_BITS        4  // latency histograms distinguish values differing by 1/16
+#define HISTOGRAM_MAX_BITS       32  // ns, 4.3 s; larger latencies are counted as the max
 
 
 #define STAT_HALFLIFE_MSEC      100
@@ -29,8 +79,15 @@
 #define STAT_LATENCY_MULTIPLIER   0.9637
 	// multiplies avg latency every block, it's halved after ~50 ms
 
+#define MIX_LIMITER_KNEE      24576  // ~ -2.5 dB, peaks of the mix above are softly compressed
+#define MIX_LIMITER_RELEASE       0.9817
+	// multiplies gain reduction of the limiter every block, it's halved after ~100 ms
+
 #define STATUS_WIDTH             79
 #define STATUS_HEIGHT           200
+#define STATUS_CLIENTS_ROWS     180  // max participant rows sent to a client, also used if its terminal height is unknown
+#define STATUS_MIN_CLIENTS_ROWS   3  // ... min
+#define STATUS_OTHER_LINES       19  // lines of the status on the client other than participant rows
 #define STATUS_LINES_PER_PACKET   4
 #define SHELO_STR_LEN           500
 
@@ -0,0 +1,106 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+// Serving metrics in Prometheus text exposition format over HTTP on a loopback TCP port;
+// connections are handled one by one by the calling thread, the body is rendered by a callback for each of them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_REQUEST_TIMEOUT_MSEC 1000
+
+// returns listening socket or -1 on error
+int metricsOpen(int port) {
+	int sfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sfd < 0) return -1;
+	int val = 1;
+	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	if ((bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(sfd, 4) != 0)) {
+		close(sfd);
+		return -1;
+	}
+	return sfd;
+}
+
+// writes label value with escaped characters
+void metricsLabel(FILE *out, const char *str) {
+	for (; *str; str++) {
+		switch (*str) {
+			case '\\': fputs("\\\\", out); break;
+			case '"':  fputs("\\\"", out); break;
+			case '\n': fputs("\\n", out);  break;
+			default:   fputc(*str, out);
+		}
+	}
+}
+
+// writes sample value followed by newline
+void metricsValue(FILE *out, double value) {
+	if (isnan(value)) {
+		fputs(" NaN\n", out);
+	} else {
+		fprintf(out, " %.9g\n", value);
+	}
+}
+
+// writes HELP and TYPE lines of a metric
+void metricsHeader(FILE *out, const char *name, const char *type, const char *help) {
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// waits for a connection, reads the request and responds with the rendered metrics;
+// returns false on error of the listening socket
+bool metricsServe(int sfd, void (*render)(FILE *out)) {
+	int cfd = accept(sfd, NULL, NULL);
+	if (cfd < 0) return false;
+
+	// the request itself is ignored, only its end is awaited
+	char request[1024];
+	size_t requestLen = 0;
+	struct pollfd pfd = {.fd = cfd, .events = POLLIN};
+	while ((requestLen < sizeof(request) - 1) && (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MSEC) > 0)) {
+		ssize_t len = recv(cfd, request + requestLen, sizeof(request) - 1 - requestLen, 0);
+		if (len <= 0) break;
+		requestLen += len;
+		request[requestLen] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+	}
+
+	char *body = NULL;
+	size_t bodyLen = 0;
+	FILE *out = open_memstream(&body, &bodyLen);
+	if (!out) {
+		close(cfd);
+		return true;
+	}
+	render(out);
+	fclose(out);
+
+	char header[128];
+	int headerLen = sprintf(header,
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"\r\n", bodyLen);
+	if (send(cfd, header, headerLen, MSG_NOSIGNAL) == headerLen) {
+		for (size_t sent = 0; sent < bodyLen; ) {
+			ssize_t len = send(cfd, body + sent, bodyLen - sent, MSG_NOSIGNAL);
+			if (len <= 0) break;
+			sent += len;
+		}
+	}
+	free(body);
+	close(cfd);
+	return true;
+}
@@ -0,0 +1,247 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   STEREO_BLOCK_SIZE (divisible by 16)
+ *   MONO_BLOCK_SIZE
+ *   MIX_LIMITER_KNEE
+ *   MIX_LIMITER_RELEASE
+ *   sample_t (int16_t)
+ */
+
+// Stereo blocks are summed into 32-bit accumulators (so that the sum of many voices cannot wrap around),
+// listener's block is then created in one pass as (mix - self) * limiter gain + leading track
+// and saturated back to 16 bits.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+typedef int32_t mixacc_t;
+#define MIX_ALIGNED __attribute__((aligned(32)))
+
+struct mixLimiter {
+	float gainPrev; // gain at the end of previous block
+	float gain;     // gain at the end of current block, reached by linear ramp
+	float reduction; // 1 - gain, decays in release phase
+};
+
+void mixClear(mixacc_t *acc) {
+	memset(acc, 0, STEREO_BLOCK_SIZE * sizeof(mixacc_t));
+}
+
+void mixAdd(mixacc_t *acc, const sample_t *block) {
+#if defined(__AVX2__)
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 16) {
+		__m256i b  = _mm256_loadu_si256((const __m256i *)(block + i));
+		__m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(b));
+		__m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(b, 1));
+		_mm256_store_si256((__m256i *)(acc + i),     _mm256_add_epi32(_mm256_load_si256((__m256i *)(acc + i)),     lo));
+		_mm256_store_si256((__m256i *)(acc + i + 8), _mm256_add_epi32(_mm256_load_si256((__m256i *)(acc + i + 8)), hi));
+	}
+#elif defined(__SSE2__)
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 8) {
+		__m128i b  = _mm_loadu_si128((const __m128i *)(block + i));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(b, b), 16); // sign extension
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(b, b), 16);
+		_mm_store_si128((__m128i *)(acc + i),     _mm_add_epi32(_mm_load_si128((__m128i *)(acc + i)),     lo));
+		_mm_store_si128((__m128i *)(acc + i + 4), _mm_add_epi32(_mm_load_si128((__m128i *)(acc + i + 4)), hi));
+	}
+#elif defined(__ARM_NEON)
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 8) {
+		int16x8_t b = vld1q_s16(block + i);
+		vst1q_s32(acc + i,     vaddw_s16(vld1q_s32(acc + i),     vget_low_s16(b)));
+		vst1q_s32(acc + i + 4, vaddw_s16(vld1q_s32(acc + i + 4), vget_high_s16(b)));
+	}
+#else
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++) {
+		acc[i] += block[i];
+	}
+#endif
+}
+
+// reduction of partial mixes
+void mixAddAcc(mixacc_t *acc, const mixacc_t *acc2) {
+#if defined(__AVX2__)
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 8) {
+		_mm256_store_si256((__m256i *)(acc + i), _mm256_add_epi32(
+					_mm256_load_si256((__m256i *)(acc + i)), _mm256_load_si256((const __m256i *)(acc2 + i))));
+	}
+#elif defined(__SSE2__)
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 4) {
+		_mm_store_si128((__m128i *)(acc + i), _mm_add_epi32(
+					_mm_load_si128((__m128i *)(acc + i)), _mm_load_si128((const __m128i *)(acc2 + i))));
+	}
+#elif defined(__ARM_NEON)
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 4) {
+		vst1q_s32(acc + i, vaddq_s32(vld1q_s32(acc + i), vld1q_s32(acc2 + i)));
+	}
+#else
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++) {
+		acc[i] += acc2[i];
+	}
+#endif
+}
+
+mixacc_t mixPeak(const mixacc_t *acc) {
+#if defined(__AVX2__)
+	__m256i max = _mm256_setzero_si256();
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 8) {
+		max = _mm256_max_epi32(max, _mm256_abs_epi32(_mm256_load_si256((const __m256i *)(acc + i))));
+	}
+	__m128i m = _mm_max_epi32(_mm256_castsi256_si128(max), _mm256_extracti128_si256(max, 1));
+	m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm_max_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(m);
+#elif defined(__SSE2__)
+	__m128i max = _mm_setzero_si128();
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 4) {
+		__m128i v = _mm_load_si128((const __m128i *)(acc + i));
+		__m128i sign = _mm_srai_epi32(v, 31);
+		v = _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+		__m128i gt = _mm_cmpgt_epi32(v, max);
+		max = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, max));
+	}
+	int32_t m[4];
+	_mm_storeu_si128((__m128i *)m, max);
+	for (int i = 1; i < 4; i++) {
+		if (m[0] < m[i]) m[0] = m[i];
+	}
+	return m[0];
+#elif defined(__ARM_NEON)
+	int32x4_t max = vdupq_n_s32(0);
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 4) {
+		max = vmaxq_s32(max, vabsq_s32(vld1q_s32(acc + i)));
+	}
+	int32_t m[4];
+	vst1q_s32(m, max);
+	for (int i = 1; i < 4; i++) {
+		if (m[0] < m[i]) m[0] = m[i];
+	}
+	return m[0];
+#else
+	mixacc_t max = 0;
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++) {
+		mixacc_t v = acc[i] < 0 ? -acc[i] : acc[i];
+		if (max < v) max = v;
+	}
+	return max;
+#endif
+}
+
+// --- master limiter ---
+
+void mixLimiterInit(struct mixLimiter *lim) {
+	lim->gainPrev = 1;
+	lim->gain = 1;
+	lim->reduction = 0;
+}
+
+// sets gain for the current block according to the peak of the whole mix;
+// soft knee above MIX_LIMITER_KNEE, instant attack (ramped within the block), exponential release
+void mixLimiterUpdate(struct mixLimiter *lim, const mixacc_t *acc) {
+	const float ceiling = INT16_MAX - MIX_LIMITER_KNEE;
+	float peak = mixPeak(acc);
+	float target = 1;
+	if (peak > MIX_LIMITER_KNEE) {
+		float over = peak - MIX_LIMITER_KNEE;
+		target = (MIX_LIMITER_KNEE + over / (1 + over / ceiling)) / peak;
+	}
+	lim->reduction *= MIX_LIMITER_RELEASE;
+	if (1 - lim->reduction > target) {
+		lim->reduction = 1 - target;
+	}
+	lim->gainPrev = lim->gain;
+	lim->gain = 1 - lim->reduction;
+	if (lim->gain > 1 - 1e-4f) lim->gain = 1;
+}
+
+// out = saturate((acc - self) * gain + leading); self and leading may be NULL
+void mixOutput(const struct mixLimiter *lim, const mixacc_t *acc, const sample_t *self, const sample_t *leading, sample_t *out) {
+	static const sample_t zeroBlock[STEREO_BLOCK_SIZE] = {};
+	if (!self)    self    = zeroBlock;
+	if (!leading) leading = zeroBlock;
+	bool unity = (lim->gainPrev == 1) && (lim->gain == 1);
+	float gainStep = (lim->gain - lim->gainPrev) / MONO_BLOCK_SIZE; // per stereo frame
+
+#if defined(__AVX2__)
+	__m256 gain  = _mm256_setr_ps(1, 1, 2, 2, 3, 3, 4, 4);
+	gain = _mm256_add_ps(_mm256_set1_ps(lim->gainPrev), _mm256_mul_ps(gain, _mm256_set1_ps(gainStep)));
+	const __m256 gainInc = _mm256_set1_ps(4 * gainStep);
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 16) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(self + i));
+		__m256i l = _mm256_loadu_si256((const __m256i *)(leading + i));
+		__m256i r[2];
+		for (int h = 0; h < 2; h++) {
+			__m128i sh = h ? _mm256_extracti128_si256(s, 1) : _mm256_castsi256_si128(s);
+			__m128i lh = h ? _mm256_extracti128_si256(l, 1) : _mm256_castsi256_si128(l);
+			__m256i v = _mm256_sub_epi32(_mm256_load_si256((const __m256i *)(acc + i + 8 * h)), _mm256_cvtepi16_epi32(sh));
+			if (!unity) {
+				v = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(v), gain));
+				gain = _mm256_add_ps(gain, gainInc);
+			}
+			r[h] = _mm256_add_epi32(v, _mm256_cvtepi16_epi32(lh));
+		}
+		// packs works within 128-bit lanes, the result has to be reordered
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(r[0], r[1]), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *)(out + i), packed);
+	}
+#elif defined(__SSE2__)
+	__m128 gain = _mm_setr_ps(1, 1, 2, 2);
+	gain = _mm_add_ps(_mm_set1_ps(lim->gainPrev), _mm_mul_ps(gain, _mm_set1_ps(gainStep)));
+	const __m128 gainInc = _mm_set1_ps(2 * gainStep);
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(self + i));
+		__m128i l = _mm_loadu_si128((const __m128i *)(leading + i));
+		__m128i r[2];
+		for (int h = 0; h < 2; h++) {
+			__m128i sh = _mm_srai_epi32(h ? _mm_unpackhi_epi16(s, s) : _mm_unpacklo_epi16(s, s), 16);
+			__m128i lh = _mm_srai_epi32(h ? _mm_unpackhi_epi16(l, l) : _mm_unpacklo_epi16(l, l), 16);
+			__m128i v = _mm_sub_epi32(_mm_load_si128((const __m128i *)(acc + i + 4 * h)), sh);
+			if (!unity) {
+				v = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(v), gain));
+				gain = _mm_add_ps(gain, gainInc);
+			}
+			r[h] = _mm_add_epi32(v, lh);
+		}
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(r[0], r[1]));
+	}
+#elif defined(__ARM_NEON)
+	const float gainInit[4] = {1, 1, 2, 2};
+	float32x4_t gain = vmlaq_n_f32(vdupq_n_f32(lim->gainPrev), vld1q_f32(gainInit), gainStep);
+	const float32x4_t gainInc = vdupq_n_f32(2 * gainStep);
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i += 8) {
+		int16x8_t s = vld1q_s16(self + i);
+		int16x8_t l = vld1q_s16(leading + i);
+		int32x4_t r[2];
+		for (int h = 0; h < 2; h++) {
+			int32x4_t v = vsubw_s16(vld1q_s32(acc + i + 4 * h), h ? vget_high_s16(s) : vget_low_s16(s));
+			if (!unity) {
+				v = vcvtq_s32_f32(vmulq_f32(vcvtq_f32_s32(v), gain));
+				gain = vaddq_f32(gain, gainInc);
+			}
+			r[h] = vaddw_s16(v, h ? vget_high_s16(l) : vget_low_s16(l));
+		}
+		vst1q_s16(out + i, vcombine_s16(vqmovn_s32(r[0]), vqmovn_s32(r[1])));
+	}
+#else
+	float gain = lim->gainPrev;
+	for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++) {
+		int32_t v = acc[i] - self[i];
+		if (!unity) {
+			if (i % 2 == 0) gain += gainStep;
+			v = lrintf(v * gain);
+		}
+		v += leading[i];
+		out[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+	}
+#endif
+}
@@ -11,20 +11,27 @@
 #include <netdb.h>
 #include <unistd.h>
 #endif
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
 
 enum packetType {
 	PACKET_HELO,
 	PACKET_DATA,
 	PACKET_STATUS,
 	PACKET_KEY_PRESS,
-	PACKET_NOOP
+	PACKET_NOOP,
+	PACKET_VIEW
 };
 
 struct packetClientHelo {
 	char type;
+	uint8_t codecs; // bitmask of supported codecs, zero means only PCM
 	uint16_t version;
 	float aioLatency;
 	float dBAdj;
@@ -32,21 +39,38 @@ struct packetClientHelo {
 };
 struct packetServerHelo {
 	char type;
-	uint8_t clientID;
+	uint8_t codecs; // bitmask of codecs accepted by the server
+	uint16_t clientID;
 	bindex_t initBlockIndex;
 	char str[SHELO_STR_LEN]; // "keys\nhelp"
 };
 struct packetClientData {
 	char type;
-	uint8_t clientID;
+	uint8_t codec;
+	uint16_t clientID;
 	bindex_t playBlockIndex; // server index to be played on the client side
 	bindex_t blockIndex;
-	sample_t block[MONO_BLOCK_SIZE];
+	bindex_t inputFrames; // captured by the sound card before the block, for drift estimation
+	uint8_t fecCopies;  // copies of preceding blocks following the data
+	uint8_t fecRequest; // number of copies requested from the server
+	union {
+		sample_t block[MONO_BLOCK_SIZE];
+		uint8_t data[MONO_BLOCK_SIZE * sizeof(sample_t)]; // coded block, packet is shortened
+	};
+	uint8_t fecData[FEC_MAX_COPIES * CODEC_ADPCM_SIZE(1)]; // space for copies, they directly follow the data
 };
 struct packetServerData {
 	char type;
+	uint8_t codec;
+	uint8_t fecCopies;
+	uint8_t fecRequest; // number of copies requested from the client
 	bindex_t blockIndex;
-	sample_t block[STEREO_BLOCK_SIZE];
+	float inputDrift;   // estimated relative rate of the client's input minus one
+	union {
+		sample_t block[STEREO_BLOCK_SIZE];
+		uint8_t data[STEREO_BLOCK_SIZE * sizeof(sample_t)];
+	};
+	uint8_t fecData[FEC_MAX_COPIES * CODEC_ADPCM_SIZE(2)];
 };
 struct packetStatusStr {
 	char type;
@@ -58,14 +82,19 @@ struct packetStatusStr {
 };
 struct packetKeyPress {
 	char type;
-	uint8_t clientID;
+	uint16_t clientID;
 	bindex_t playBlockIndex;
 	bindex_t keyPressIndex;
 	int key;
 };
 struct packetClientNoop {
 	char type;
-	uint8_t clientID;
+	uint16_t clientID;
+};
+struct packetClientView {
+	char type;
+	uint16_t clientID;
+	uint16_t height;    // of the terminal in lines, 0 if unknown
 };
 
 union packet {
@@ -75,6 +104,7 @@ union packet {
 	struct packetServerData sData;
 	struct packetStatusStr  sStat;
 	struct packetKeyPress   cKeyP;
+	struct packetClientView cView;
 };
 
 
@@ -82,6 +112,209 @@ bool netAddrsEqual(struct sockaddr_storage *addr1, struct sockaddr_storage *addr
 	return memcmp(addr1, addr2, sizeof(struct sockaddr_storage)) == 0;
 }
 
+// normalized address usable as a hash key, IPv4 addresses are mapped to IPv6
+struct netAddrKey {
+	uint16_t family;
+	uint16_t port;
+	uint32_t scope;
+	uint8_t addr[16];
+};
+
+void netAddrKeyFrom(struct netAddrKey *key, struct sockaddr_storage *addr) {
+	memset(key, 0, sizeof(struct netAddrKey));
+	key->family = AF_INET6;
+	if (addr->ss_family == AF_INET) {
+		struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+		key->port = addr4->sin_port;
+		key->addr[10] = key->addr[11] = 0xff;
+		memcpy(key->addr + 12, &addr4->sin_addr, 4);
+	} else if (addr->ss_family == AF_INET6) {
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
+		key->port = addr6->sin6_port;
+		key->scope = addr6->sin6_scope_id;
+		memcpy(key->addr, &addr6->sin6_addr, 16);
+	} else {
+		key->family = addr->ss_family;
+	}
+}
+
+bool netAddrKeysEqual(const struct netAddrKey *key1, const struct netAddrKey *key2) {
+	uint64_t a[3], b[3];
+	memcpy(a, key1, sizeof(a));
+	memcpy(b, key2, sizeof(b));
+	return ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2])) == 0;
+}
+
+uint32_t netAddrKeyHash(const struct netAddrKey *key) {
+	uint64_t a[3];
+	memcpy(a, key, sizeof(a));
+	uint64_t h = a[0] * 0x9e3779b97f4a7c15ull;
+	h = (h ^ a[1] ^ (h >> 29)) * 0xbf58476d1ce4e5b9ull;
+	h = (h ^ a[2] ^ (h >> 32)) * 0x94d049bb133111ebull;
+	return h ^ (h >> 31) ^ (h >> 47);
+}
+
+typedef void netBatchFailedCallback(void *owner, int err);
+
+// io_uring backend, if NET_URING_ALLOWED is defined by the including file
+// and kernel headers are new enough for multishot receiving into a ring of provided buffers (6.0)
+#if defined(NET_URING_ALLOWED) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define NET_URING
+#include "netUring.h"
+#endif
+#endif
+#endif
+
+
+// --- batched sending of datagrams to different addresses ---
+
+#ifndef NET_BATCH_SIZE
+#define NET_BATCH_SIZE 64
+#endif
+
+struct netBatch {
+	size_t cnt;
+	void *owners[NET_BATCH_SIZE]; // passed back to the callback in case of failure
+#ifdef __linux__
+	struct mmsghdr msgs[NET_BATCH_SIZE];
+	struct iovec iovs[NET_BATCH_SIZE];
+#else
+	struct sockaddr_storage *addrs[NET_BATCH_SIZE];
+	void *data[NET_BATCH_SIZE];
+	size_t sizes[NET_BATCH_SIZE];
+#endif
+#ifdef NET_URING
+	struct netUringSend *uring; // if set, datagrams are only queued there by flushing
+#endif
+};
+
+void netBatchInit(struct netBatch *batch) {
+	batch->cnt = 0;
+#ifdef NET_URING
+	batch->uring = NULL;
+#endif
+}
+
+// sends all staged datagrams using as few syscalls as possible
+void netBatchFlush(int sfd, struct netBatch *batch, netBatchFailedCallback *failed) {
+	size_t i = 0;
+#ifdef NET_URING
+	if (batch->uring) {
+		netUringSendQueue(batch->uring, batch->msgs, batch->owners, batch->cnt, sfd);
+		batch->cnt = 0;
+		return;
+	}
+#endif
+#ifdef __linux__
+	while (i < batch->cnt) {
+		int sent = sendmmsg(sfd, batch->msgs + i, batch->cnt - i, 0);
+		if (sent < 0) {
+			// the first remaining message failed
+			failed(batch->owners[i++], errno);
+		} else {
+			i += sent;
+		}
+	}
+#else
+	for (; i < batch->cnt; i++) {
+		if (sendto(sfd, batch->data[i], batch->sizes[i], 0, (struct sockaddr *)batch->addrs[i], sizeof(struct sockaddr_storage)) < 0) {
+			failed(batch->owners[i], errno);
+		}
+	}
+#endif
+	batch->cnt = 0;
+}
+
+// data and addr have to stay valid until flushed, full batch is flushed immediately
+void netBatchAdd(int sfd, struct netBatch *batch, struct sockaddr_storage *addr, void *data, size_t size, void *owner, netBatchFailedCallback *failed) {
+	size_t i = batch->cnt++;
+	batch->owners[i] = owner;
+#ifdef __linux__
+	batch->iovs[i] = (struct iovec) { .iov_base = data, .iov_len = size };
+	batch->msgs[i] = (struct mmsghdr) { .msg_hdr = {
+		.msg_name = addr,
+		.msg_namelen = sizeof(struct sockaddr_storage),
+		.msg_iov = &batch->iovs[i],
+		.msg_iovlen = 1 } };
+#else
+	batch->addrs[i] = addr;
+	batch->data[i] = data;
+	batch->sizes[i] = size;
+#endif
+	if (batch->cnt >= NET_BATCH_SIZE) {
+		netBatchFlush(sfd, batch, failed);
+	}
+}
+
+
+// --- batched receiving of datagrams ---
+
+struct netRecvBatch {
+	char *packets[NET_BATCH_SIZE]; // received data, followed by one writable byte
+	ssize_t sizes[NET_BATCH_SIZE];
+	struct sockaddr_storage addrs[NET_BATCH_SIZE];
+	char packetsRaw[NET_BATCH_SIZE][sizeof(union packet) + 1]; // one extra byte for terminating strings
+	struct timespec stamps[NET_BATCH_SIZE]; // kernel receive times (CLOCK_REALTIME), zero if not known
+#ifdef __linux__
+	struct mmsghdr msgs[NET_BATCH_SIZE];
+	struct iovec iovs[NET_BATCH_SIZE];
+	char controls[NET_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))];
+#endif
+#ifdef NET_URING
+	struct netUringRecv *uring; // if set, used instead of recvmmsg
+#endif
+};
+
+void netRecvBatchInit(struct netRecvBatch *batch) {
+	memset(batch, 0, sizeof(struct netRecvBatch));
+	for (size_t i = 0; i < NET_BATCH_SIZE; i++) {
+		batch->packets[i] = batch->packetsRaw[i];
+	}
+#ifdef __linux__
+	for (size_t i = 0; i < NET_BATCH_SIZE; i++) {
+		batch->iovs[i] = (struct iovec) { .iov_base = batch->packetsRaw[i], .iov_len = sizeof(union packet) };
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+		batch->msgs[i].msg_hdr.msg_control = batch->controls[i];
+	}
+#endif
+}
+
+// waits for at least one datagram and returns all already available ones (at most NET_BATCH_SIZE);
+// returns their count or -1 on error
+int netRecvBatch(int sfd, struct netRecvBatch *batch) {
+#ifdef NET_URING
+	if (batch->uring) {
+		return netUringRecv(batch->uring, batch->packets, batch->sizes, batch->addrs, NET_BATCH_SIZE);
+	}
+#endif
+#ifdef __linux__
+	for (size_t i = 0; i < NET_BATCH_SIZE; i++) {
+		batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		batch->msgs[i].msg_hdr.msg_controllen = sizeof(batch->controls[i]);
+	}
+	int cnt = recvmmsg(sfd, batch->msgs, NET_BATCH_SIZE, MSG_WAITFORONE, NULL);
+	for (int i = 0; i < cnt; i++) {
+		batch->sizes[i] = batch->msgs[i].msg_len;
+		batch->stamps[i] = (struct timespec) {0, 0};
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&batch->msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&batch->msgs[i].msg_hdr, cmsg)) {
+			if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+				memcpy(&batch->stamps[i], CMSG_DATA(cmsg), sizeof(struct timespec));
+			}
+		}
+	}
+	return cnt;
+#else
+	socklen_t addrLen = sizeof(struct sockaddr_storage);
+	batch->sizes[0] = recvfrom(sfd, batch->packetsRaw[0], sizeof(union packet), 0, (struct sockaddr *)&batch->addrs[0], &addrLen);
+	return batch->sizes[0] < 0 ? -1 : 1;
+#endif
+}
+
 int netInit() {
 #ifdef __WIN32__
 	{
@@ -99,7 +332,7 @@ void netCleanup() {
 #endif
 }
 
-int netOpenPort(char *port) {
+int netOpenPort(char *port, bool reusePort) {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
 	int sfd, s;
@@ -130,6 +363,16 @@ int netOpenPort(char *port) {
 			 if (sfd == -1)
 					 continue;
 
+#ifdef SO_REUSEPORT
+			 if (reusePort) {
+				 int val = 1;
+				 if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) != 0) {
+					 close(sfd);
+					 continue;
+				 }
+			 }
+#endif
+
 			 if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0)
 					 break;                  /* Success */
 
@@ -146,6 +389,34 @@ int netOpenPort(char *port) {
 	 return sfd;
 }
 
+// the kernel is asked to attach receive times to datagrams, they are then returned by netRecvBatch
+bool netRecvTimestamps(int sfd) {
+#ifdef SO_TIMESTAMPNS
+	int val = 1;
+	return setsockopt(sfd, SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val)) == 0;
+#else
+	return false;
+#endif
+}
+
+// datagrams for the group of sockets sharing the port are assigned by the cpu which received them
+bool netSteerReusePortByCpu(int sfd, int socketsCnt) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	struct sock_filter code[] = {
+		{ BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, socketsCnt },
+		{ BPF_RET | BPF_A,           0, 0, 0 }
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code
+	};
+	return setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+#else
+	return false;
+#endif
+}
+
 int netOpenConn(char *addr, char *port) {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
@@ -0,0 +1,325 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+// io_uring backend for batched sending and receiving of datagrams (Linux only, included from net.h);
+// raw syscalls are used to avoid dependency on liburing,
+// initialization fails (returns false) on kernels without multishot receive (< 6.0).
+
+/* needed defs:
+ *   union packet
+ *   netBatchFailedCallback
+ */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NET_URING_RECV_BUFS 256 // power of two
+
+struct netUring {
+	int fd;
+	bool sqpoll;
+	unsigned *sqHead, *sqTail, *sqMask, *sqFlags, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sqTailLocal;   // prepared sqes, published to sqTail by netUringSubmit
+	unsigned sqTailSubmitted;
+	void *sqRing, *cqRing;
+	size_t sqRingSize, cqRingSize, sqesSize;
+};
+
+bool netUringInit(struct netUring *ring, unsigned entries, bool sqpoll) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if (sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 1000; // ms
+	}
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) return false;
+	ring->sqpoll = sqpoll;
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqesSize   = params.sq_entries * sizeof(struct io_uring_sqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize) ring->sqRingSize = ring->cqRingSize;
+		ring->cqRingSize = ring->sqRingSize;
+	}
+	ring->sqRing = mmap(0, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		close(ring->fd);
+		return false;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqRing = ring->sqRing;
+	} else {
+		ring->cqRing = mmap(0, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED) {
+			munmap(ring->sqRing, ring->sqRingSize);
+			close(ring->fd);
+			return false;
+		}
+	}
+	ring->sqes = mmap(0, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+		munmap(ring->sqRing, ring->sqRingSize);
+		close(ring->fd);
+		return false;
+	}
+
+	ring->sqHead  = (unsigned *)((char *)ring->sqRing + params.sq_off.head);
+	ring->sqTail  = (unsigned *)((char *)ring->sqRing + params.sq_off.tail);
+	ring->sqMask  = (unsigned *)((char *)ring->sqRing + params.sq_off.ring_mask);
+	ring->sqFlags = (unsigned *)((char *)ring->sqRing + params.sq_off.flags);
+	ring->sqArray = (unsigned *)((char *)ring->sqRing + params.sq_off.array);
+	ring->cqHead  = (unsigned *)((char *)ring->cqRing + params.cq_off.head);
+	ring->cqTail  = (unsigned *)((char *)ring->cqRing + params.cq_off.tail);
+	ring->cqMask  = (unsigned *)((char *)ring->cqRing + params.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *)((char *)ring->cqRing + params.cq_off.cqes);
+	ring->sqTailLocal = ring->sqTailSubmitted = *ring->sqTail;
+	return true;
+}
+
+void netUringDestroy(struct netUring *ring) {
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+}
+
+// returns zeroed sqe or NULL if the submission queue is full
+struct io_uring_sqe *netUringGetSqe(struct netUring *ring) {
+	unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+	if (ring->sqTailLocal - head > *ring->sqMask) return NULL;
+	unsigned index = ring->sqTailLocal++ & *ring->sqMask;
+	ring->sqArray[index] = index;
+	memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+	return &ring->sqes[index];
+}
+
+// publishes prepared sqes and waits for at least waitCnt completions or until timeout (if not NULL);
+// with SQPOLL the syscall is avoided unless waiting or the polling thread sleeps
+int netUringSubmit(struct netUring *ring, unsigned waitCnt, struct __kernel_timespec *timeout) {
+	unsigned flags = 0;
+	unsigned submitCnt = ring->sqTailLocal - ring->sqTailSubmitted;
+	__atomic_store_n(ring->sqTail, ring->sqTailLocal, __ATOMIC_RELEASE);
+	ring->sqTailSubmitted = ring->sqTailLocal;
+	if (ring->sqpoll) {
+		__sync_synchronize();
+		if (__atomic_load_n(ring->sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		} else if (!waitCnt) {
+			return 0;
+		}
+		submitCnt = 0;
+	} else if (!submitCnt && !waitCnt) {
+		return 0;
+	}
+	if (waitCnt) flags |= IORING_ENTER_GETEVENTS;
+	if (waitCnt && timeout) {
+		struct io_uring_getevents_arg arg = { .ts = (uintptr_t)timeout };
+		return syscall(__NR_io_uring_enter, ring->fd, submitCnt, waitCnt, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+	return syscall(__NR_io_uring_enter, ring->fd, submitCnt, waitCnt, flags, NULL, 0);
+}
+
+// returns the oldest unseen cqe or NULL
+struct io_uring_cqe *netUringPeekCqe(struct netUring *ring, unsigned skip) {
+	unsigned head = *ring->cqHead + skip;
+	if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+	return &ring->cqes[head & *ring->cqMask];
+}
+
+void netUringCqesSeen(struct netUring *ring, unsigned cnt) {
+	__atomic_store_n(ring->cqHead, *ring->cqHead + cnt, __ATOMIC_RELEASE);
+}
+
+
+// --- sending: sqes are queued by more threads, submitted once per tick ---
+
+struct netUringSend {
+	struct netUring ring;
+	pthread_mutex_t mutex;
+	unsigned inflight;
+	struct netUringSendSlot {    // indexed as sqes, the kernel copies them on submission (IORING_FEAT_SUBMIT_STABLE)
+		struct msghdr hdr;
+		struct iovec iov;
+	} *slots;
+};
+
+bool netUringSendInit(struct netUringSend *send, unsigned entries, bool sqpoll) {
+	if (!netUringInit(&send->ring, entries, sqpoll)) return false;
+	send->slots = calloc(*send->ring.sqMask + 1, sizeof(struct netUringSendSlot));
+	if (!send->slots) {
+		netUringDestroy(&send->ring);
+		return false;
+	}
+	pthread_mutex_init(&send->mutex, NULL);
+	send->inflight = 0;
+	return true;
+}
+
+// calls failed for all completed sends which failed;
+// if wait is set, all queued datagrams are sent before returning, so their data can be reused
+void netUringSendReap(struct netUringSend *send, bool wait, netBatchFailedCallback *failed) {
+	pthread_mutex_lock(&send->mutex);
+	if (wait && send->inflight) {
+		netUringSubmit(&send->ring, send->inflight, NULL);
+	}
+	struct io_uring_cqe *cqe;
+	unsigned cnt = 0;
+	while ((cqe = netUringPeekCqe(&send->ring, cnt))) {
+		if (cqe->res < 0) failed((void *)(uintptr_t)cqe->user_data, -cqe->res);
+		cnt++;
+	}
+	netUringCqesSeen(&send->ring, cnt);
+	send->inflight -= cnt;
+	pthread_mutex_unlock(&send->mutex);
+}
+
+// data referenced by msgs have to stay valid until reaped with wait set
+void netUringSendQueue(struct netUringSend *send, struct mmsghdr *msgs, void **owners, size_t cnt, int sfd) {
+	pthread_mutex_lock(&send->mutex);
+	for (size_t i = 0; i < cnt; i++) {
+		struct io_uring_sqe *sqe;
+		while (!(sqe = netUringGetSqe(&send->ring))) {
+			netUringSubmit(&send->ring, 0, NULL); // the queue is full, submit immediately
+			if (!send->ring.sqpoll) continue;
+			pthread_mutex_unlock(&send->mutex);
+			sched_yield();
+			pthread_mutex_lock(&send->mutex);
+		}
+		struct netUringSendSlot *slot = &send->slots[sqe - send->ring.sqes];
+		slot->hdr = msgs[i].msg_hdr;
+		slot->iov = *msgs[i].msg_hdr.msg_iov;
+		slot->hdr.msg_iov = &slot->iov;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sfd;
+		sqe->addr = (uintptr_t)&slot->hdr;
+		sqe->len = 1;
+		sqe->user_data = (uintptr_t)owners[i];
+		send->inflight++;
+	}
+	pthread_mutex_unlock(&send->mutex);
+}
+
+void netUringSendSubmit(struct netUringSend *send) {
+	pthread_mutex_lock(&send->mutex);
+	netUringSubmit(&send->ring, 0, NULL);
+	pthread_mutex_unlock(&send->mutex);
+}
+
+
+// --- receiving: multishot recvmsg into kernel-selected provided buffers ---
+
+struct netUringRecv {
+	struct netUring ring;
+	int sfd;
+	bool armed;
+	struct msghdr msg;            // template describing the layout of the buffers
+	struct io_uring_buf_ring *bufRing;
+	char *bufs;
+	size_t bufLen;
+	unsigned bufTail;
+	unsigned seenCqes;            // cqes of the last batch, their buffers are returned with the next call
+	uint16_t usedBids[NET_URING_RECV_BUFS];
+	size_t usedCnt;
+};
+
+#define NET_URING_RECV_BUF_LEN (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + sizeof(union packet))
+#define NET_URING_RECV_BUF_STRIDE ((NET_URING_RECV_BUF_LEN + 1 + 15) & ~15) // one extra byte for terminating strings
+
+void netUringRecvReturnBuf(struct netUringRecv *recv, uint16_t bid) {
+	struct io_uring_buf *buf = &recv->bufRing->bufs[recv->bufTail++ & (NET_URING_RECV_BUFS - 1)];
+	buf->addr = (uintptr_t)(recv->bufs + (size_t)bid * NET_URING_RECV_BUF_STRIDE);
+	buf->len = NET_URING_RECV_BUF_LEN;
+	buf->bid = bid;
+}
+
+bool netUringRecvInit(struct netUringRecv *recv, int sfd, bool sqpoll) {
+	memset(recv, 0, sizeof(struct netUringRecv));
+	if (!netUringInit(&recv->ring, 8, sqpoll)) return false;
+	recv->sfd = sfd;
+	recv->msg.msg_namelen = sizeof(struct sockaddr_storage);
+
+	size_t ringSize = NET_URING_RECV_BUFS * sizeof(struct io_uring_buf);
+	recv->bufRing = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	recv->bufs = malloc(NET_URING_RECV_BUFS * NET_URING_RECV_BUF_STRIDE);
+	if ((recv->bufRing == MAP_FAILED) || !recv->bufs) goto fail;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)recv->bufRing;
+	reg.ring_entries = NET_URING_RECV_BUFS;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, recv->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) goto fail;
+
+	for (unsigned i = 0; i < NET_URING_RECV_BUFS; i++) {
+		netUringRecvReturnBuf(recv, i);
+	}
+	__atomic_store_n(&recv->bufRing->tail, recv->bufTail, __ATOMIC_RELEASE);
+	return true;
+
+fail:
+	if (recv->bufRing != MAP_FAILED) munmap(recv->bufRing, ringSize);
+	free(recv->bufs);
+	netUringDestroy(&recv->ring);
+	return false;
+}
+
+// the same semantics as netRecvBatch except for returning 0 after timeout, packets point to the internal buffers valid until the next call
+int netUringRecv(struct netUringRecv *recv, char **packets, ssize_t *sizes, struct sockaddr_storage *addrs, size_t maxCnt) {
+	for (size_t i = 0; i < recv->usedCnt; i++) {
+		netUringRecvReturnBuf(recv, recv->usedBids[i]);
+	}
+	recv->usedCnt = 0;
+	__atomic_store_n(&recv->bufRing->tail, recv->bufTail, __ATOMIC_RELEASE);
+	netUringCqesSeen(&recv->ring, recv->seenCqes);
+	recv->seenCqes = 0;
+
+	if (!recv->armed) {
+		struct io_uring_sqe *sqe = netUringGetSqe(&recv->ring);
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = recv->sfd;
+		sqe->addr = (uintptr_t)&recv->msg;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		recv->armed = true;
+	}
+	struct __kernel_timespec timeout = { .tv_sec = 0, .tv_nsec = 100000000 }; // shutdown of the socket does not wake us up
+	if (netUringSubmit(&recv->ring, netUringPeekCqe(&recv->ring, 0) ? 0 : 1, &timeout) < 0) {
+		return (errno == EINTR) || (errno == ETIME) ? 0 : -1;
+	}
+
+	int cnt = 0;
+	struct io_uring_cqe *cqe;
+	while (((size_t)cnt < maxCnt) && (cqe = netUringPeekCqe(&recv->ring, recv->seenCqes))) {
+		recv->seenCqes++;
+		if (!(cqe->flags & IORING_CQE_F_MORE)) recv->armed = false;
+		if (cqe->res < 0) {
+			if (cqe->res == -ENOBUFS) continue; // re-armed with the next call
+			errno = -cqe->res;
+			return -1;
+		}
+		if (!(cqe->flags & IORING_CQE_F_BUFFER)) continue;
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		recv->usedBids[recv->usedCnt++] = bid;
+
+		char *buf = recv->bufs + (size_t)bid * NET_URING_RECV_BUF_STRIDE;
+		struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+		size_t nameLen = out->namelen < recv->msg.msg_namelen ? out->namelen : recv->msg.msg_namelen;
+		memset(&addrs[cnt], 0, sizeof(struct sockaddr_storage));
+		memcpy(&addrs[cnt], buf + sizeof(struct io_uring_recvmsg_out), nameLen);
+		packets[cnt] = buf + sizeof(struct io_uring_recvmsg_out) + recv->msg.msg_namelen + recv->msg.msg_controllen;
+		sizes[cnt] = out->flags & MSG_TRUNC ? 0 : out->payloadlen; // truncated datagrams are ignored
+		cnt++;
+	}
+	return cnt;
+}
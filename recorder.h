@@ -0,0 +1,517 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   RECORDER_RING_SIZE     (multiple of 8)
+ *   RECORDER_WRITE_BLOCKS
+ *   RECORDER_GAP_MAX_BLOCKS
+ *   RECORDER_MAX_TRACKS
+ *   RECORDER_FLAC
+ *   RECORDER_SEEK_POINTS
+ *   SAMPLE_RATE
+ *   MONO_BLOCK_SIZE
+ *   NAME_LEN
+ *   bindex_t
+ *   sample_t
+ */
+
+// Recording of tracks to FLAC files, or WAV files (RF64 if larger than 4 GB), aligned by block index:
+// a realtime thread puts blocks of tracks to a lock-free single-producer single-consumer ring,
+// a writer thread of its own collects them by track and writes each track in large chunks;
+// data not fitting to the full ring are dropped and counted.
+// FLAC chunks are compressed by threads of shared encoders, the chunks of all tracks filled at once in parallel;
+// each chunk starts a point of the seek table reserved in the header, which is thinned when full.
+// A track starts with its first block and ends when no block comes for RECORDER_GAP_MAX_BLOCKS,
+// shorter gaps are filled with silence; an unnamed track never ends, so all its gaps are filled.
+// Multitrack recording writes each track to its own file and lists starts, gaps and ends of tracks in an index file;
+// otherwise a single track is expected.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#define RECORDER_ALIGN 4096 // the header is padded to it
+#define RECORDER_HEADER_SIZE (RECORDER_FLAC ? FLAC_HEADER_SIZE(RECORDER_SEEK_POINTS, RECORDER_ALIGN) : RECORDER_ALIGN)
+#define RECORDER_EXT (RECORDER_FLAC ? "flac" : "wav")
+#define RECORDER_CHUNK_FRAMES (RECORDER_WRITE_BLOCKS * MONO_BLOCK_SIZE / FLAC_BLOCK_SIZE)
+#if RECORDER_CHUNK_FRAMES * FLAC_BLOCK_SIZE != RECORDER_WRITE_BLOCKS * MONO_BLOCK_SIZE
+#error RECORDER_WRITE_BLOCKS has to give whole FLAC frames.
+#endif
+
+// cumulative, shared by all recordings
+struct recorderStats {
+	size_t rawBytes;
+	size_t codedBytes;
+	size_t encodeNsec;    // CPU time of encoding
+	size_t dropped;       // blocks
+	size_t ringMax;       // bytes waiting in the ring, the max since reset by the reader
+};
+
+// threads compressing chunks of any recorder, one recorder at a time
+struct recorderEncoders {
+	struct workerPool pool;
+	pthread_mutex_t mutex;
+	struct recorderStats stats;
+};
+
+struct recorderEntry {
+	bindex_t blockIndex;
+	uint32_t track;
+	uint8_t channels;   // 0 marks skipping the rest of the ring
+	char name[NAME_LEN + 1];
+	sample_t data[];
+};
+#define RECORDER_ENTRY_SIZE(CHANNELS) ((sizeof(struct recorderEntry) + (CHANNELS) * MONO_BLOCK_SIZE * sizeof(sample_t) + 7) & ~7)
+
+// owned by the writer thread
+struct recorderTrack {
+	bool active;
+	bool named;
+	uint32_t key;
+	int fd;
+	int channels;
+	size_t blockSize;  // in bytes
+	bindex_t nextBlock;
+	uint64_t dataSize; // written, compressed
+	uint64_t samples;  // per channel, written
+	uint8_t *chunk;    // RECORDER_WRITE_BLOCKS blocks to be written
+	size_t chunkBlocks;
+	uint8_t *coded;    // the chunk compressed, if codedSize > 0
+	size_t codedSize;
+	uint64_t chunks;   // written
+	struct flacSeekPoint *seekPoints;
+	size_t seekPointsCnt;
+	size_t seekPointsStep; // chunks between points
+	char filename[320];
+};
+
+struct recorder {
+	uint8_t *ring;
+	volatile size_t writePos, readPos; // in bytes since start, written only by the producer and the consumer respectively
+	size_t dropped;   // blocks, written only by the producer
+	volatile bool stopping;
+	int error;        // errno of the first failed operation, 0 if none
+	pthread_t thread;
+	void (*threadInit)();
+	struct recorderEncoders *encoders;
+	struct recorderTrack *ready[RECORDER_MAX_TRACKS]; // with full chunks to be compressed
+	size_t readyCnt;
+	bool multitrack;
+	FILE *index;      // of multitrack recording
+	size_t tracksCnt; // started so far
+	struct recorderTrack tracks[RECORDER_MAX_TRACKS];
+	char basename[256];
+};
+
+static void recorderPut32(uint8_t *p, uint32_t v) {
+	for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+static void recorderPut64(uint8_t *p, uint64_t v) {
+	for (int i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+
+// header of the given size of data, RF64 one if it doesn't fit to RIFF sizes;
+// chunks: RIFF/RF64, JUNK/ds64 reserved for RF64 sizes, JUNK padding, fmt, data
+void recorderHeader(int channels, uint8_t *header, uint64_t dataSize) {
+	memset(header, 0, RECORDER_ALIGN);
+	uint64_t riffSize = RECORDER_ALIGN - 8 + dataSize;
+	bool rf64 = riffSize > UINT32_MAX;
+	uint8_t *p = header;
+
+	memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+	recorderPut32(p + 4, rf64 ? UINT32_MAX : riffSize);
+	memcpy(p + 8, "WAVE", 4);
+	p += 12;
+
+	memcpy(p, rf64 ? "ds64" : "JUNK", 4);
+	recorderPut32(p + 4, 28);
+	if (rf64) {
+		recorderPut64(p + 8, riffSize);
+		recorderPut64(p + 16, dataSize);
+		recorderPut64(p + 24, dataSize / (channels * sizeof(sample_t)));
+		recorderPut32(p + 32, 0); // table length
+	}
+	p += 8 + 28;
+
+	uint8_t *fmt = header + RECORDER_ALIGN - 8 - 24;
+	memcpy(p, "JUNK", 4);
+	recorderPut32(p + 4, fmt - p - 8);
+	p = fmt;
+
+	memcpy(p, "fmt ", 4);
+	recorderPut32(p + 4, 16);
+	p[8] = 1; // PCM
+	p[10] = channels;
+	recorderPut32(p + 12, SAMPLE_RATE);
+	recorderPut32(p + 16, SAMPLE_RATE * channels * sizeof(sample_t));
+	p[20] = channels * sizeof(sample_t);
+	p[22] = 8 * sizeof(sample_t);
+	p += 24;
+
+	memcpy(p, "data", 4);
+	recorderPut32(p + 4, rf64 ? UINT32_MAX : dataSize);
+}
+
+static void recorderTrackHeader(struct recorderTrack *t, uint8_t *header) {
+	if (RECORDER_FLAC) {
+		flacHeader(header, t->channels, SAMPLE_RATE, t->samples, t->seekPoints, t->seekPointsCnt, RECORDER_SEEK_POINTS, RECORDER_ALIGN);
+	} else {
+		recorderHeader(t->channels, header, t->dataSize);
+	}
+}
+
+static bool recorderWriteAll(int fd, const void *data, size_t size, off_t offset) {
+	while (size > 0) {
+		ssize_t len = pwrite(fd, data, size, offset);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		data += len;
+		size -= len;
+		offset += len;
+	}
+	return true;
+}
+
+static void recorderFail(struct recorder *r) {
+	if (!r->error) r->error = errno;
+}
+
+static bool recorderTrackExpired(struct recorderTrack *t, bindex_t blockIndex) {
+	return t->named && ((bindex_t)(blockIndex - t->nextBlock) >= RECORDER_GAP_MAX_BLOCKS);
+}
+
+// --- writer thread ---
+
+static uint64_t recorderCpuNsec() {
+	struct timespec tp;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &tp);
+	return tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+// compresses the chunk, may be called by any thread
+static void recorderTrackEncode(struct recorder *r, struct recorderTrack *t) {
+	uint64_t startNsec = recorderCpuNsec();
+	size_t samples = t->chunkBlocks * MONO_BLOCK_SIZE;
+	uint64_t frame = t->samples / FLAC_BLOCK_SIZE; // only the last chunk may be shorter
+	t->codedSize = 0;
+	for (size_t i = 0; i < samples; i += FLAC_BLOCK_SIZE) {
+		size_t cnt = samples - i < FLAC_BLOCK_SIZE ? samples - i : FLAC_BLOCK_SIZE;
+		t->codedSize += flacEncodeFrame(t->coded + t->codedSize, (sample_t *)t->chunk + i * t->channels, t->channels, cnt, frame++, SAMPLE_RATE);
+	}
+	__sync_fetch_and_add(&r->encoders->stats.encodeNsec, recorderCpuNsec() - startNsec);
+}
+
+static void recorderEncodeJob(void *recorderPtr, size_t worker, size_t workersCnt) {
+	struct recorder *r = recorderPtr;
+	for (size_t i = worker; i < r->readyCnt; i += workersCnt) {
+		recorderTrackEncode(r, r->ready[i]);
+	}
+}
+
+// the chunk to be written starts a seek point if it is on the step, the table full is thinned to every other point
+static void recorderTrackSeekPoint(struct recorderTrack *t) {
+	if (t->chunks % t->seekPointsStep) return;
+	if (t->seekPointsCnt == RECORDER_SEEK_POINTS) {
+		for (size_t i = 0; 2 * i < RECORDER_SEEK_POINTS; i++) t->seekPoints[i] = t->seekPoints[2 * i];
+		t->seekPointsCnt = (RECORDER_SEEK_POINTS + 1) / 2;
+		t->seekPointsStep *= 2;
+		if (t->chunks % t->seekPointsStep) return;
+	}
+	size_t samples = t->chunkBlocks * MONO_BLOCK_SIZE;
+	t->seekPoints[t->seekPointsCnt++] = (struct flacSeekPoint) {
+		.sample = t->samples,
+		.offset = t->dataSize,
+		.samples = samples < FLAC_BLOCK_SIZE ? samples : FLAC_BLOCK_SIZE};
+}
+
+static void recorderTrackFlush(struct recorder *r, struct recorderTrack *t) {
+	if (!t->chunkBlocks) return;
+	const uint8_t *data = t->chunk;
+	size_t rawSize = t->chunkBlocks * t->blockSize;
+	size_t size = rawSize;
+	if (RECORDER_FLAC) {
+		if (!t->codedSize) recorderTrackEncode(r, t);
+		recorderTrackSeekPoint(t);
+		data = t->coded;
+		size = t->codedSize;
+	}
+	if ((t->fd >= 0) && !recorderWriteAll(t->fd, data, size, RECORDER_HEADER_SIZE + t->dataSize)) {
+		recorderFail(r);
+		close(t->fd);
+		t->fd = -1;
+	}
+	__sync_fetch_and_add(&r->encoders->stats.rawBytes, rawSize);
+	__sync_fetch_and_add(&r->encoders->stats.codedBytes, size);
+	t->dataSize += size;
+	t->samples += t->chunkBlocks * MONO_BLOCK_SIZE;
+	t->chunks++;
+	t->chunkBlocks = 0;
+	t->codedSize = 0;
+}
+
+// full chunks of all tracks are compressed in parallel, then written
+static void recorderFlushReady(struct recorder *r) {
+	r->readyCnt = 0;
+	for (size_t i = 0; i < RECORDER_MAX_TRACKS; i++) {
+		struct recorderTrack *t = &r->tracks[i];
+		if (t->active && (t->chunkBlocks >= RECORDER_WRITE_BLOCKS)) r->ready[r->readyCnt++] = t;
+	}
+	if (!r->readyCnt) return;
+	if (RECORDER_FLAC) {
+		pthread_mutex_lock(&r->encoders->mutex);
+		workerPoolRun(&r->encoders->pool, r->readyCnt, &recorderEncodeJob, r);
+		pthread_mutex_unlock(&r->encoders->mutex);
+	}
+	for (size_t i = 0; i < r->readyCnt; i++) {
+		recorderTrackFlush(r, r->ready[i]);
+	}
+}
+
+static void recorderTrackPut(struct recorder *r, struct recorderTrack *t, const sample_t *block) {
+	if (t->chunkBlocks >= RECORDER_WRITE_BLOCKS) recorderTrackFlush(r, t); // filled again before recorderFlushReady
+	if (block) {
+		memcpy(t->chunk + t->chunkBlocks * t->blockSize, block, t->blockSize);
+	} else {
+		memset(t->chunk + t->chunkBlocks * t->blockSize, 0, t->blockSize);
+	}
+	t->chunkBlocks++;
+	t->nextBlock++;
+}
+
+static struct recorderTrack *recorderTrackStart(struct recorder *r, struct recorderEntry *e) {
+	struct recorderTrack *t = NULL;
+	for (size_t i = 0; i < RECORDER_MAX_TRACKS; i++) {
+		if (!r->tracks[i].active) {
+			t = &r->tracks[i];
+			break;
+		}
+	}
+	if (!t) return NULL;
+
+	if (r->multitrack && e->name[0]) {
+		char name[NAME_LEN + 1];
+		size_t len = 0;
+		for (const char *c = e->name; *c && (len < NAME_LEN); c++) {
+			bool safe = ((*c >= 'a') && (*c <= 'z')) || ((*c >= 'A') && (*c <= 'Z')) || ((*c >= '0') && (*c <= '9')) || (*c == '-');
+			name[len++] = safe ? *c : '_';
+		}
+		while ((len > 0) && (name[len - 1] == '_')) len--; // padding
+		name[len] = '\0';
+		snprintf(t->filename, sizeof(t->filename), "%s_%03zu_%s.%s", r->basename, r->tracksCnt, name, RECORDER_EXT);
+	} else {
+		snprintf(t->filename, sizeof(t->filename), "%s.%s", r->basename, RECORDER_EXT);
+	}
+	r->tracksCnt++;
+
+	t->active = true;
+	t->named = e->name[0];
+	t->key = e->track;
+	t->channels = e->channels;
+	t->blockSize = e->channels * MONO_BLOCK_SIZE * sizeof(sample_t);
+	t->nextBlock = e->blockIndex;
+	t->dataSize = 0;
+	t->samples = 0;
+	t->chunkBlocks = 0;
+	t->codedSize = 0;
+	t->chunks = 0;
+	t->seekPointsCnt = 0;
+	t->seekPointsStep = 1;
+	t->chunk = malloc(RECORDER_WRITE_BLOCKS * t->blockSize);
+	t->coded = RECORDER_FLAC ? malloc(RECORDER_CHUNK_FRAMES * FLAC_MAX_FRAME_SIZE(t->channels)) : NULL;
+	t->seekPoints = RECORDER_FLAC ? malloc(RECORDER_SEEK_POINTS * sizeof(struct flacSeekPoint)) : NULL;
+	t->fd = open(t->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	uint8_t header[RECORDER_HEADER_SIZE];
+	recorderTrackHeader(t, header); // valid even if not finalized
+	if (!t->chunk || (RECORDER_FLAC && (!t->coded || !t->seekPoints)) ||
+			(t->fd < 0) || !recorderWriteAll(t->fd, header, sizeof(header), 0)) {
+		recorderFail(r);
+		if (t->fd >= 0) close(t->fd);
+		free(t->chunk);
+		free(t->coded);
+		free(t->seekPoints);
+		t->active = false;
+		return NULL;
+	}
+	if (r->index) fprintf(r->index, "start\t%u\t%s\t%s\n", e->blockIndex, t->filename, e->name);
+	return t;
+}
+
+static void recorderTrackEnd(struct recorder *r, struct recorderTrack *t) {
+	recorderTrackFlush(r, t);
+	if (t->fd >= 0) {
+		uint8_t header[RECORDER_HEADER_SIZE];
+		recorderTrackHeader(t, header);
+		if (!recorderWriteAll(t->fd, header, sizeof(header), 0)) recorderFail(r);
+		if (close(t->fd) != 0) recorderFail(r);
+	}
+	if (r->index) fprintf(r->index, "end\t%u\t%s\n", t->nextBlock, t->filename);
+	free(t->chunk);
+	free(t->coded);
+	free(t->seekPoints);
+	t->active = false;
+}
+
+static void recorderWriteEntry(struct recorder *r, struct recorderEntry *e) {
+	struct recorderTrack *t = NULL;
+	for (size_t i = 0; i < RECORDER_MAX_TRACKS; i++) {
+		if (r->tracks[i].active && (r->tracks[i].key == e->track)) {
+			t = &r->tracks[i];
+			break;
+		}
+	}
+	if (t && ((e->channels != t->channels) || recorderTrackExpired(t, e->blockIndex))) {
+		recorderTrackEnd(r, t);
+		t = NULL;
+	}
+	if (!t && !(t = recorderTrackStart(r, e))) return;
+	if (t->nextBlock != e->blockIndex) {
+		if (r->index) fprintf(r->index, "gap\t%u\t%u\t%s\n", t->nextBlock, e->blockIndex - t->nextBlock, t->filename);
+		while (t->nextBlock != e->blockIndex) recorderTrackPut(r, t, NULL);
+	}
+	recorderTrackPut(r, t, e->data);
+}
+
+static void *recorderWriter(void *recorderPtr) {
+	struct recorder *r = recorderPtr;
+	if (r->threadInit) r->threadInit();
+	bindex_t blockIndex = 0;
+	bool started = false;
+
+	while (true) {
+		bool stopping = r->stopping;
+		__sync_synchronize();
+		size_t writePos = r->writePos;
+		if (r->readPos == writePos) {
+			if (stopping) break;
+			usleep(1000000ull * RECORDER_GAP_MAX_BLOCKS * MONO_BLOCK_SIZE / SAMPLE_RATE / 16);
+			continue;
+		}
+		__sync_synchronize();
+		size_t pos = r->readPos;
+		if (writePos - pos > r->encoders->stats.ringMax) r->encoders->stats.ringMax = writePos - pos;
+		while (pos != writePos) {
+			size_t offset = pos % RECORDER_RING_SIZE;
+			struct recorderEntry *e = (struct recorderEntry *)(r->ring + offset);
+			if ((RECORDER_RING_SIZE - offset < sizeof(struct recorderEntry)) || !e->channels) {
+				pos += RECORDER_RING_SIZE - offset;
+				continue;
+			}
+			if (!started || (e->blockIndex != blockIndex)) {
+				// tracks without blocks for too long are ended
+				for (size_t i = 0; i < RECORDER_MAX_TRACKS; i++) {
+					struct recorderTrack *t = &r->tracks[i];
+					if (t->active && recorderTrackExpired(t, e->blockIndex)) recorderTrackEnd(r, t);
+				}
+				blockIndex = e->blockIndex;
+				started = true;
+			}
+			recorderWriteEntry(r, e);
+			pos += RECORDER_ENTRY_SIZE(e->channels);
+		}
+		__sync_synchronize();
+		r->readPos = pos;
+		recorderFlushReady(r);
+	}
+
+	for (size_t i = 0; i < RECORDER_MAX_TRACKS; i++) {
+		if (r->tracks[i].active) recorderTrackEnd(r, &r->tracks[i]);
+	}
+	if (r->index && (fclose(r->index) != 0)) recorderFail(r);
+
+	if (r->error) {
+		printf("Recording '%s' failed: %s.\n", r->basename, strerror(r->error));
+	} else {
+		printf("Recording '%s' saved, %zu file%s", r->basename, r->tracksCnt, r->tracksCnt == 1 ? "" : "s");
+		if (r->dropped) printf(", %zu blocks dropped as the disk or compression was too slow", r->dropped);
+		printf(".\n");
+	}
+	free(r->ring);
+	free(r);
+	return NULL;
+}
+
+// --- interface ---
+
+// creates threadsCnt - 1 threads calling threadInit, the writer thread of a recorder being the remaining one;
+// returns number of threads actually available
+size_t recorderEncodersInit(struct recorderEncoders *encoders, size_t threadsCnt, void (*threadInit)()) {
+	pthread_mutex_init(&encoders->mutex, NULL);
+	return workerPoolInit(&encoders->pool, threadsCnt, threadInit);
+}
+
+// starts writer thread, which calls threadInit if set and compresses by the initialized encoders;
+// files are named by basename, index of multitrack recording is created immediately; returns NULL on error
+struct recorder *recorderStart(const char *basename, bool multitrack, void (*threadInit)(), struct recorderEncoders *encoders) {
+	struct recorder *r = calloc(1, sizeof(struct recorder));
+	if (!r) return NULL;
+	r->threadInit = threadInit;
+	r->encoders = encoders;
+	r->multitrack = multitrack;
+	snprintf(r->basename, sizeof(r->basename), "%s", basename);
+	if (posix_memalign((void **)&r->ring, RECORDER_ALIGN, RECORDER_RING_SIZE) != 0) {
+		free(r);
+		return NULL;
+	}
+	if (multitrack) {
+		char filename[320];
+		snprintf(filename, sizeof(filename), "%s.txt", basename);
+		if (!(r->index = fopen(filename, "w"))) {
+			free(r->ring);
+			free(r);
+			return NULL;
+		}
+		fprintf(r->index, "# event, block index (%d frames at %d Hz), ...: start, file, name; gap filled with silence, blocks, file; end, file\n",
+				MONO_BLOCK_SIZE, SAMPLE_RATE);
+	}
+	if (pthread_create(&r->thread, NULL, &recorderWriter, r) != 0) {
+		if (r->index) fclose(r->index);
+		free(r->ring);
+		free(r);
+		return NULL;
+	}
+	pthread_detach(r->thread);
+	return r;
+}
+
+// to be called by the producer only, blocks of each track are expected in the order of their indices;
+// returns false if the block was dropped
+bool recorderPut(struct recorder *r, bindex_t blockIndex, uint32_t track, const char *name, int channels, const sample_t *block) {
+	size_t size = RECORDER_ENTRY_SIZE(channels);
+	size_t offset = r->writePos % RECORDER_RING_SIZE;
+	size_t skip = 0;
+	if (RECORDER_RING_SIZE - offset < size) skip = RECORDER_RING_SIZE - offset; // the entry continues from the ring start
+	if (r->writePos + skip + size - r->readPos > RECORDER_RING_SIZE) {
+		r->dropped++;
+		__sync_fetch_and_add(&r->encoders->stats.dropped, 1);
+		return false;
+	}
+	if (skip) {
+		if (skip >= sizeof(struct recorderEntry)) ((struct recorderEntry *)(r->ring + offset))->channels = 0;
+		offset = 0;
+	}
+	struct recorderEntry *e = (struct recorderEntry *)(r->ring + offset);
+	e->blockIndex = blockIndex;
+	e->track = track;
+	e->channels = channels;
+	strncpy(e->name, name, NAME_LEN);
+	e->name[NAME_LEN] = '\0';
+	memcpy(e->data, block, channels * MONO_BLOCK_SIZE * sizeof(sample_t));
+	__sync_synchronize();
+	r->writePos += skip + size;
+	return true;
+}
+
+// to be called by the producer after its last put;
+// the writer thread writes the rest, finalizes the files, reports the result and frees the recorder
+void recorderStop(struct recorder *r) {
+	__sync_synchronize();
+	r->stopping = true;
+}
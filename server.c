@@ -15,6 +15,17 @@
 #include "audioBuffer.h"
 #include "stereoBuffer.h"
 #include "surround.h"
+#include "mixer.h"
+#include "workerPool.h"
+#include "codec.h"
+#include "fec.h"
+#include "drift.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "flac.h"
+#include "recorder.h"
+#include "backingTrack.h"
+#define NET_URING_ALLOWED
 #include "net.h"
 #include "tty.h"
 #include "threadPriority.h"
@@ -24,8 +35,17 @@ struct client {
 	bool connectedMain;   // main thread can change to equal connected
 	bool connectedStatus; // status thread can change to equal connected
 		// all connected* must be unset before reusing
-	uint8_t id;
+	bool bufferReleasing; // main thread sets before unsetting connectedMain and unsets after releasing buffer's pages
+	unsigned releaseEpochs[SERVER_RECV_THREADS]; // of receiver threads when disconnected by main thread
+	uint16_t id;
+	uint16_t session;     // incremented on each connection
+	int recvThread;       // index of the only receiver thread accepting client's packets
+	int recvPrevThread;   // ... before it was taken over, may still be processing packets accepted before
+	unsigned recvPrevEpoch; // of recvPrevThread when taken over
+	int64_t recvThreadUsec; // of the last packet accepted by recvThread
+	enum codecType codec; // of sent data
 	struct sockaddr_storage addr;
+	struct netAddrKey addrKey;
 	int64_t lastPacketUsec;
 	float aioLatency;
 	float restLatency;
@@ -39,17 +59,40 @@ struct client {
 	bindex_t lastKeyPressIndex;
 	bindex_t lastKeyPress;
 	sample_t lastReadBlock[STEREO_BLOCK_SIZE];
+	struct packetServerData dataPacket; // staged for batched sending
+	struct fecSender fec;
+	uint8_t fecCopies;                  // requested by the client
+	struct driftEstimator drift;        // of the client's input against the mixer
 	struct surroundCtx surroundCtx;
 	struct audioBuffer buffer;
 	struct packetStatusStr statusPacket;
 	char *statusPacketPos;
+	int statusLines;      // in the current status packet, -1 before the first line of status
+	size_t statusRow;     // index in the participant list of the current status
+	uint16_t viewHeight;  // of the client's terminal, 0 if unknown
+	size_t viewOffset;    // first participant row shown to the client
+	size_t sendErrors;
 	char name[NAME_LEN + 1];
 };
-struct client *clients[MAX_CLIENTS];
-struct client *clientsOrdered[MAX_CLIENTS]; // may temporarily contain duplicit/missing items
-
-int udpSocket = -1;
-pthread_t udpThread;
+struct client *clients[MAX_CLIENTS]; // indexed by id, never freed
+
+// dense ordered list of clients, which may be connected;
+// changed by receiver threads under clientsMutex, other threads read its snapshots
+struct clientList {
+	unsigned version; // odd during changes
+	size_t cnt;
+	struct client *items[MAX_CLIENTS];
+} clientsList;
+
+int udpSockets[SERVER_RECV_THREADS];
+int udpSocket = -1; // the first one, used for sending
+pthread_t udpThreads[SERVER_RECV_THREADS];
+pthread_mutex_t clientsMutex = PTHREAD_MUTEX_INITIALIZER; // for changes of clients by more receiver threads
+#ifdef NET_URING
+bool udpUring = false;
+struct netUringRecv udpUringRecv[SERVER_RECV_THREADS];
+struct netUringSend udpUringSend;
+#endif
 bindex_t blockIndex = 0;
 int64_t usecZero;
 
@@ -58,10 +101,26 @@ enum { SP_NICE, SP_REALTIME, SP_DEADLINE } schedPolicy;
 struct {
 	bool enabled;
 	bool inclLeader;
-	FILE *file;
+	bool stems;                // each participant and the leading track are recorded also separately
+	struct recorder *recorder; // set before enabling, stopped and unset by the mixer after disabling
 	bindex_t startTime;
 } recording;
 
+// tracks of recording, participants are identified by id and session
+#define RECORDING_TRACK_MIX     UINT32_MAX
+#define RECORDING_TRACK_LEADING (UINT32_MAX - 1)
+
+void recordingThreadInit() {
+	threadPriorityNice(19);
+	threadPinCpu(SERVER_STATUS_CPU);
+}
+
+// not pinned to run in parallel, still never preempting the mixer
+void recordingEncoderInit() {
+	threadPriorityNice(19);
+}
+struct recorderEncoders recordingEncoders;
+
 struct {
 	bool enabled;
 	float beatsPerMinute;
@@ -78,6 +137,38 @@ struct {
 	struct stereoBuffer buffer;
 } leading;
 
+struct {
+	struct backingTrack *track; // NULL if not given
+	bool playing;               // requested
+	bool started;               // by the mixer, which writes the blocks to the leading buffer
+	bindex_t nextTime;          // of the next block written to the leading buffer
+	size_t pos;                 // of the next block written within the track
+} backing;
+
+void backingThreadInit() {
+	threadPinCpu(SERVER_STATUS_CPU);
+}
+
+// position within the backing track played now
+size_t backingPlayedPos() {
+	if (!backing.started) return backing.pos;
+	size_t ahead = backing.nextTime - blockIndex - 1; // written for the following ticks
+	return backing.pos > ahead ? backing.pos - ahead : 0;
+}
+
+// in blocks, given by the metronome settings
+float backingBarBlocks() {
+	return (float)SAMPLE_RATE / MONO_BLOCK_SIZE / metronome.beatsPerMinute * 60 * (metronome.beatsPerBar ? metronome.beatsPerBar : 1);
+}
+
+void backingSeekBar(ssize_t bar) {
+	size_t pos = bar > 0 ? bar * backingBarBlocks() + 0.5 : 0;
+	backingTrackSeek(backing.track, pos);
+	if (!backing.started) backing.pos = pos; // otherwise updated by the mixer
+}
+
+struct mixLimiter limiter;
+
 int64_t getUsec(int64_t zero) {
 	struct timespec tp;
 	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
@@ -100,57 +191,151 @@ volatile enum udpState {
 	ms -= 1000 * s; s -= 60 * m; m -= 60 * h; \
 	printf("[%02d:%02d:%02d.%03d] " fmt "%s\n", (int)(h), (int)(m), (int)(s), (int)(ms), __VA_ARGS__); }
 
-inline struct client *getClient(size_t c) {
-	struct client *client = clients[c];
-	if (!client || !client->connected) return NULL;
+// to be called under clientsMutex
+inline void clientsListChangeBegin() {
+	clientsList.version++;
 	__sync_synchronize();
-	return client;
 }
-
-inline struct client *getClientOrdered(size_t c) {
-	struct client *client = clientsOrdered[c];
-	if (!client || !client->connected) return NULL;
+inline void clientsListChangeEnd() {
 	__sync_synchronize();
-	return client;
+	clientsList.version++;
 }
+
+void clientsListSnapshot(struct clientList *list) {
+	unsigned version;
+	do {
+		while ((version = clientsList.version) & 1);
+		__sync_synchronize();
+		list->cnt = clientsList.cnt;
+		memcpy(list->items, clientsList.items, list->cnt * sizeof(struct client *));
+		__sync_synchronize();
+	} while (clientsList.version != version);
+}
+
+// list of clients used by the current thread and their connected field, both redefined later
+#define CLIENTS_LIST clientsList
 #define CLIENT_CONNECTED_FIELD connected
 
 #define FOR_CLIENTS(CLIENT) \
-	for (size_t CLIENT##_INDEX = 0; CLIENT##_INDEX < MAX_CLIENTS; CLIENT##_INDEX++) \
-	for (struct client *CLIENT = clients[CLIENT##_INDEX]; CLIENT && CLIENT->CLIENT_CONNECTED_FIELD; CLIENT=NULL)
+	for (size_t CLIENT##_INDEX = 0; CLIENT##_INDEX < CLIENTS_LIST.cnt; CLIENT##_INDEX++) \
+	for (struct client *CLIENT = CLIENTS_LIST.items[CLIENT##_INDEX]; CLIENT && CLIENT->CLIENT_CONNECTED_FIELD; CLIENT=NULL)
+
+
+// address to client lookup table;
+// open addressing with linear probing, changed by receiver threads under clientsMutex, read without locking;
+// found clients are verified, so reading during a change may only cause a miss
+#define CLIENTS_ADDR_TABLE_SIZE 2048 // power of two, at least twice MAX_CLIENTS
+#define CLIENTS_ADDR_REMOVED ((struct client *)1)
+
+struct clientsAddrTable {
+	size_t used; // incl. removed
+	struct clientsAddrEntry {
+		struct client *client; // NULL if never used
+		struct netAddrKey key;
+	} entries[CLIENTS_ADDR_TABLE_SIZE];
+} clientsAddrTables[2]; // the other one is used for rebuilding
+struct clientsAddrTable *volatile clientsAddr = &clientsAddrTables[0];
+
+struct client *clientsAddrLookup(struct netAddrKey *key) {
+	struct clientsAddrTable *table = clientsAddr;
+	size_t i = netAddrKeyHash(key);
+	for (size_t n = 0; n < CLIENTS_ADDR_TABLE_SIZE; n++, i++) {
+		struct clientsAddrEntry *entry = &table->entries[i & (CLIENTS_ADDR_TABLE_SIZE - 1)];
+		struct client *client = entry->client;
+		if (!client) break;
+		if ((client == CLIENTS_ADDR_REMOVED) || !netAddrKeysEqual(&entry->key, key)) continue;
+		__sync_synchronize();
+		if (client->connected && netAddrKeysEqual(&client->addrKey, key)) return client;
+		break;
+	}
+	return NULL;
+}
+
+void clientsAddrSet(struct clientsAddrTable *table, struct client *client) {
+	struct clientsAddrEntry *free = NULL;
+	size_t i = netAddrKeyHash(&client->addrKey);
+	for (size_t n = 0; n < CLIENTS_ADDR_TABLE_SIZE; n++, i++) {
+		struct clientsAddrEntry *entry = &table->entries[i & (CLIENTS_ADDR_TABLE_SIZE - 1)];
+		if (!entry->client) {
+			if (!free) {
+				free = entry;
+				table->used++;
+			}
+			break;
+		} else if (entry->client == CLIENTS_ADDR_REMOVED) {
+			if (!free) free = entry;
+		} else if (netAddrKeysEqual(&entry->key, &client->addrKey)) {
+			entry->client = client; // replacing disconnected client with the same address
+			return;
+		}
+	}
+	free->key = client->addrKey;
+	__sync_synchronize();
+	free->client = client;
+}
+
+void clientsAddrInsert(struct client *client) {
+	struct clientsAddrTable *table = clientsAddr;
+	if (table->used >= CLIENTS_ADDR_TABLE_SIZE * 3 / 4) { // too many removed entries
+		struct clientsAddrTable *newTable = table == &clientsAddrTables[0] ? &clientsAddrTables[1] : &clientsAddrTables[0];
+		memset(newTable, 0, sizeof(struct clientsAddrTable));
+		for (size_t i = 0; i < CLIENTS_ADDR_TABLE_SIZE; i++) {
+			struct client *client2 = table->entries[i].client;
+			if (client2 && (client2 != CLIENTS_ADDR_REMOVED)) {
+				clientsAddrSet(newTable, client2);
+			}
+		}
+		__sync_synchronize();
+		clientsAddr = table = newTable;
+	}
+	clientsAddrSet(table, client);
+}
+
+void clientsAddrRemove(struct client *client) {
+	struct clientsAddrTable *table = clientsAddr;
+	size_t i = netAddrKeyHash(&client->addrKey);
+	for (size_t n = 0; n < CLIENTS_ADDR_TABLE_SIZE; n++, i++) {
+		struct clientsAddrEntry *entry = &table->entries[i & (CLIENTS_ADDR_TABLE_SIZE - 1)];
+		if (!entry->client) break;
+		if (entry->client == client) {
+			entry->client = CLIENTS_ADDR_REMOVED;
+			break;
+		}
+	}
+}
 
-#define FOR_CLIENTS_ORDERED(CLIENT) \
-	for (size_t CLIENT##_INDEX = 0; CLIENT##_INDEX < MAX_CLIENTS; CLIENT##_INDEX++) \
-	for (struct client *CLIENT = clientsOrdered[CLIENT##_INDEX]; CLIENT && CLIENT->CLIENT_CONNECTED_FIELD; CLIENT=NULL)
 
 void clientsSurroundReinit() {
 	size_t clientsCnt = 0;
 	FOR_CLIENTS(client) clientsCnt++;
 
 	size_t i = 0;
-	FOR_CLIENTS_ORDERED(client) {
+	FOR_CLIENTS(client) {
 		surroundInitCtx(&client->surroundCtx, client->dBAdj, M_PI * (((float)i++ + 1e-20) / (clientsCnt-1 + 2e-20) - 0.5f), 2);
 	}
 }
 
-struct client *newClient() {
+struct client *newClient(struct sockaddr_storage *addr) {
 	struct client *client = NULL;
 	for (ssize_t i = 0; i < MAX_CLIENTS; i++) {
 		if (!clients[i]) {
-			client = malloc(sizeof(struct client));
+			client = calloc(1, sizeof(struct client)); // session counted from zero
 			if (!client) {
 				msg("Cannot allocate memory for a new client, refusing...");
 				return NULL;
 			}
 			client->id = i;
+			bufferInit(&client->buffer, 0);
 			client->connected = false;
 			client->connectedMain = false;
 			client->connectedStatus = false;
+			client->bufferReleasing = false;
 			__sync_synchronize();
 			clients[i] = client;
 			break;
-		} else if (!clients[i]->connected && !clients[i]->connectedStatus) {
+		} else if (!clients[i]->connected && !clients[i]->connectedMain && !clients[i]->connectedStatus && !clients[i]->bufferReleasing) {
 			client = clients[i];
+			clientsAddrRemove(client);
 			break;
 		}
 	}
@@ -160,31 +345,50 @@ struct client *newClient() {
 		return NULL;
 	}
 
+	clientsListChangeBegin();
 	size_t i = 0;
-	for (size_t j = 0; j < MAX_CLIENTS; j++) {
-		if (clientsOrdered[j] && clientsOrdered[j]->connected && (clientsOrdered[j] != client)) {
-			if (i < j) {
-				clientsOrdered[i] = clientsOrdered[j];
-			}
-			i++;
+	for (size_t j = 0; j < clientsList.cnt; j++) {
+		struct client *client2 = clientsList.items[j];
+		if ((client2->connected || client2->connectedStatus) && (client2 != client)) {
+			clientsList.items[i++] = client2;
 		}
 	}
-	clientsOrdered[i++] = client;
-	for (; i < MAX_CLIENTS; i++) {
-		clientsOrdered[i] = NULL;
-	}
-	__sync_synchronize();
+	clientsList.items[i++] = client;
+	clientsList.cnt = i;
+	clientsListChangeEnd();
+
+	client->addr = *addr;
+	netAddrKeyFrom(&client->addrKey, addr);
+	clientsAddrInsert(client);
 	return client;
 }
 
+// removes disconnected clients already unset by all threads
+void clientsListPrune() {
+	clientsListChangeBegin();
+	size_t i = 0;
+	for (size_t j = 0; j < clientsList.cnt; j++) {
+		struct client *client = clientsList.items[j];
+		if (client->connected || client->connectedStatus) {
+			clientsList.items[i++] = client;
+		} else {
+			clientsAddrRemove(client);
+		}
+	}
+	clientsList.cnt = i;
+	clientsListChangeEnd();
+}
+
 void clientMoveUp(struct client *client) {
 	ssize_t i = -1;
-	for (ssize_t j = 0; j < MAX_CLIENTS; j++) {
-		if (clientsOrdered[j] && clientsOrdered[j]->connected) {
-			if (clientsOrdered[j] == client) {
+	for (size_t j = 0; j < clientsList.cnt; j++) {
+		if (clientsList.items[j]->connected) {
+			if (clientsList.items[j] == client) {
 				if (i >= 0) {
-					clientsOrdered[j] = clientsOrdered[i];
-					clientsOrdered[i] = client;
+					clientsListChangeBegin();
+					clientsList.items[j] = clientsList.items[i];
+					clientsList.items[i] = client;
+					clientsListChangeEnd();
 				}
 				break;
 			}
@@ -196,13 +400,15 @@ void clientMoveUp(struct client *client) {
 
 void clientMoveDown(struct client *client) {
 	ssize_t i = -1;
-	for (ssize_t j = 0; j < MAX_CLIENTS; j++) {
-		if (clientsOrdered[j] && clientsOrdered[j]->connected) {
+	for (size_t j = 0; j < clientsList.cnt; j++) {
+		if (clientsList.items[j]->connected) {
 			if (i >= 0) {
-				clientsOrdered[i] = clientsOrdered[j];
-				clientsOrdered[j] = client;
+				clientsListChangeBegin();
+				clientsList.items[i] = clientsList.items[j];
+				clientsList.items[j] = client;
+				clientsListChangeEnd();
 				break;
-			} else if (clientsOrdered[j] == client) {
+			} else if (clientsList.items[j] == client) {
 				i = j;
 			}
 		}
@@ -211,15 +417,21 @@ void clientMoveDown(struct client *client) {
 }
 
 ssize_t udpSendPacket(struct client *client, void *packet, size_t size) {
-	return sendto(udpSocket, packet, size, 0, (struct sockaddr *)&client->addr, sizeof(client->addr));
+	ssize_t ret = sendto(udpSocket, packet, size, 0, (struct sockaddr *)&client->addr, sizeof(client->addr));
+	if (ret < 0) __sync_fetch_and_add(&client->sendErrors, 1);
+	return ret;
 }
 
 void udpRecvHelo(struct client *client, struct packetClientHelo *packet) {
 	sprintf(client->name, "%-" STR(NAME_LEN) "s", packet->name);
+	client->codec = codecPreferred(packet->codecs);
+	client->fecCopies = 0;
+	fecSenderReset(&client->fec);
+	driftReset(&client->drift);
 
 	bufferClear(&client->buffer, 0);
 	client->lastPacketUsec = getUsec(usecZero);
-	client->aioLatency = packet->aioLatency;
+	client->aioLatency = !(packet->aioLatency >= 0) ? 0 : packet->aioLatency > 9999 ? 9999 : packet->aioLatency; // ms, 0 if unknown
 	client->dBAdj = packet->dBAdj;
 	client->muted = false;
 	client->mutedMic = false;
@@ -230,13 +442,18 @@ void udpRecvHelo(struct client *client, struct packetClientHelo *packet) {
 	client->lastKeyPressIndex = 0;
 	client->leadingDelay = 0;
 	client->restLatencyAvg = FLT_MAX;
+	client->viewHeight = 0;
+	client->viewOffset = 0;
+	client->sendErrors = 0;
+	client->session++;
 	__sync_synchronize();
 	client->connected = true;
 
 	struct packetServerHelo packetR = {};
+	packetR.codecs = CODECS_SUPPORTED;
 	packetR.clientID = client->id;
 	packetR.initBlockIndex = blockIndex;
-	strncpy(packetR.str, "durRmjkhlJKLAS-+",
+	strncpy(packetR.str, "durRtmjkhlJKLAS-+<>pP[]",
 		SHELO_STR_LEN);
 
 	udpSendPacket(client, &packetR, (void *)strchr(packetR.str, '\0') - (void *)&packetR);
@@ -256,6 +473,14 @@ void udpRecvData(struct client *client, struct packetClientData *packet) {
 	client->lastPacketUsec = getUsec(usecZero);
 }
 
+// number of participant rows fitting the client's terminal
+size_t statusViewRows(struct client *client) {
+	if (!client->viewHeight) return STATUS_CLIENTS_ROWS;
+	if (client->viewHeight < STATUS_OTHER_LINES + STATUS_MIN_CLIENTS_ROWS) return STATUS_MIN_CLIENTS_ROWS;
+	if (client->viewHeight > STATUS_OTHER_LINES + STATUS_CLIENTS_ROWS) return STATUS_CLIENTS_ROWS;
+	return client->viewHeight - STATUS_OTHER_LINES;
+}
+
 void udpRecvKeyPress(struct client *client, struct packetKeyPress *packet) {
 	switch (packet->key) {
 		case 'u': // move up
@@ -266,25 +491,32 @@ void udpRecvKeyPress(struct client *client, struct packetKeyPress *packet) {
 			clientMoveDown(client);
 			break;
 
+		case '<': // scroll list up by a page
+			client->viewOffset -= client->viewOffset < statusViewRows(client) - 1 ? client->viewOffset : statusViewRows(client) - 1;
+			break;
+
+		case '>': // scroll list down by a page, limited later by the number of participants
+			client->viewOffset += statusViewRows(client) - 1;
+			break;
+
 		case 'r': // toggle recording incl. leader
 		case 'R': // ... excl. leader
-			if (!recording.enabled) {
-				char filename[100];
+		case 't': // ... with stems
+			if (recording.enabled) {
+				recording.enabled = false;
+			} else if (!recording.recorder) { // the previous one already stopped
+				char basename[100];
 				time_t t = time(NULL);
-				strftime(filename, sizeof(filename), "rehearsal_%Y-%m-%d_%H-%M-%S." STR(SAMPLE_RATE) "s16le2ch", localtime(&t));
-				recording.file = fopen(filename, "w");
-				if (recording.file) {
+				strftime(basename, sizeof(basename), "rehearsal_%Y-%m-%d_%H-%M-%S", localtime(&t));
+				recording.recorder = recorderStart(basename, packet->key == 't', &recordingThreadInit, &recordingEncoders);
+				if (recording.recorder) {
 					recording.startTime = blockIndex;
-					recording.inclLeader = (packet->key == 'r');
+					recording.inclLeader = (packet->key != 'R');
+					recording.stems = (packet->key == 't');
 					__sync_synchronize();
 					recording.enabled = true;
-				}
-			} else {
-				recording.enabled = false;
-				__sync_synchronize();
-				if (recording.file) {
-					fclose(recording.file);
-					recording.file = NULL;
+				} else {
+					msg("Cannot create recording '%s'...", basename);
 				}
 			}
 			break;
@@ -294,6 +526,7 @@ void udpRecvKeyPress(struct client *client, struct packetKeyPress *packet) {
 				metronome.enabled = false;
 			} else {
 				FOR_CLIENTS(client) client->isLeader = false;
+				backing.playing = false;
 				metronome.lastBeatTime = 0;
 				__sync_synchronize();
 				metronome.enabled = true;
@@ -353,104 +586,316 @@ void udpRecvKeyPress(struct client *client, struct packetKeyPress *packet) {
 				FOR_CLIENTS(client) client->isLeader = false;
 				client->isLeader = true;
 				metronome.enabled = false;
+				backing.playing = false;
 			}
 			break;
+
+		case 'p': // toggle playing backing track
+			if (!backing.track) break;
+			if (backing.playing) {
+				backing.playing = false;
+			} else {
+				FOR_CLIENTS(client) client->isLeader = false;
+				metronome.enabled = false;
+				__sync_synchronize();
+				backing.playing = true;
+			}
+			break;
+		case 'P': // rewind backing track
+			if (backing.track) backingSeekBar(0);
+			break;
+		case '[': // seek backing track to the previous bar
+			if (backing.track) backingSeekBar((ssize_t)(backingPlayedPos() / backingBarBlocks()) - 1);
+			break;
+		case ']': // ... to the next bar
+			if (backing.track) backingSeekBar((ssize_t)(backingPlayedPos() / backingBarBlocks()) + 1);
+			break;
+	}
+}
+
+// histogram of numbers of datagrams received by one syscall, i-th bucket for (2^(i-1), 2^i]
+#define UDP_RECV_BATCH_BUCKETS (__builtin_ctz(NET_BATCH_SIZE) + 1)
+size_t udpRecvBatchHist[UDP_RECV_BATCH_BUCKETS];
+
+size_t udpRecvForeignCnt = 0; // packets received by other than client's thread, dropped
+size_t udpRecvHandoverCnt = 0; // clients taken over by other receiver threads
+
+// incremented by each receiver thread before and after processing a batch of packets, odd meanwhile
+volatile unsigned udpRecvEpochs[SERVER_RECV_THREADS];
+
+// whether the thread can process client's packet;
+// it takes the client over from its receiver thread, which has not received its packets for a while,
+// e.g. after the flow was steered to another cpu, but writes to the buffer only after the previous one finished its batch
+bool udpRecvOwner(struct client *client, int thread) {
+	int64_t usec = getUsec(usecZero);
+	int owner = client->recvThread;
+	if (owner != thread) {
+		if ((usec - client->recvThreadUsec < (int64_t)SERVER_RECV_HANDOVER_BLOCKS * 1000000 * MONO_BLOCK_SIZE / SAMPLE_RATE) ||
+				!__sync_bool_compare_and_swap(&client->recvThread, owner, thread)) {
+			__sync_fetch_and_add(&udpRecvForeignCnt, 1);
+			return false;
+		}
+		client->recvPrevThread = owner;
+		client->recvPrevEpoch = udpRecvEpochs[owner];
+		__sync_fetch_and_add(&udpRecvHandoverCnt, 1);
+	}
+	unsigned epoch = client->recvPrevEpoch;
+	if ((epoch & 1) && (udpRecvEpochs[client->recvPrevThread] == epoch)) {
+		__sync_fetch_and_add(&udpRecvForeignCnt, 1);
+		return false;
+	}
+	client->recvThreadUsec = usec;
+	return true;
+}
+
+struct {
+	size_t upRaw, upCoded;     // bytes of received blocks before and after coding
+	size_t downRaw, downCoded; // ... of sent blocks
+} codecStats;
+
+struct {
+	size_t upRecovered; // blocks written from redundant copies
+} fecStats;
+
+// --- latency histograms ---
+
+enum latencyStage {
+	LATENCY_WAKE,      // of the mixer after its deadline
+	LATENCY_READ,      // reading from client buffers, per worker
+	LATENCY_SURROUND,  // ... spatialization
+	LATENCY_MIX,       // ... partial mixing, the first worker also merges the partial mixes
+	LATENCY_SEND,      // ... per-listener mixes, coding and sending
+	LATENCY_METRONOME,
+	LATENCY_BACKING,   // reading the backing track ahead
+	LATENCY_RECORD,
+	LATENCY_TICK,      // whole processing of the tick
+	LATENCY_RECV,      // from kernel receive time to writing into a client buffer
+	LATENCY_STAGES
+};
+const char *latencyStageNames[LATENCY_STAGES] = {"wake", "read", "surround", "mix", "send", "metronome", "backing", "record", "tick", "recv"};
+
+// each histogram is written by a single thread, the status thread merges them
+struct histogram mixerLatency[WORKER_POOL_MAX_THREADS][LATENCY_STAGES]; // worker 0 is the main thread
+struct histogram recvLatency[SERVER_RECV_THREADS];
+volatile bool latencyDumpRequested = false;
+
+struct {
+	size_t caughtUp, dropped; // since start
+} mixerTickStats;
+
+void sigusr1Handler(int signum) {
+	latencyDumpRequested = true;
+}
+
+// merges histograms of all threads by stage
+void latencyMerge(struct histogram *merged) {
+	memset(merged, 0, LATENCY_STAGES * sizeof(struct histogram));
+	__sync_synchronize();
+	for (int s = 0; s < LATENCY_STAGES; s++) {
+		for (int w = 0; w < WORKER_POOL_MAX_THREADS; w++) {
+			histogramMerge(&merged[s], &mixerLatency[w][s]);
+		}
+	}
+	for (int t = 0; t < SERVER_RECV_THREADS; t++) {
+		histogramMerge(&merged[LATENCY_RECV], &recvLatency[t]);
 	}
 }
 
-void *udpReceiver(void *none) {
-	char packetRaw[sizeof(union packet) + 1];
-	union packet *packet = (union packet *) &packetRaw;
-	ssize_t size;
-	struct sockaddr_storage addr = {};
+// prints percentiles of latencies since the previous call, or since start if total
+void latencyPrint(bool total) {
+	static struct histogram prev[LATENCY_STAGES];
+	struct histogram cur[LATENCY_STAGES];
+	latencyMerge(cur);
+
+	printf("LATENCY %-5s     count      p50      p99    p99.9      max  us\n", total ? "TOTAL" : "");
+	for (int s = 0; s < LATENCY_STAGES; s++) {
+		struct histogram h = cur[s];
+		if (!total) {
+			histogramSubtract(&h, &prev[s]);
+			prev[s] = cur[s];
+		}
+		printf("%-13s %10lu %8.1f %8.1f %8.1f %8.1f\n", latencyStageNames[s], histogramCount(&h),
+				histogramQuantile(&h, 0.5) / 1000.0, histogramQuantile(&h, 0.99) / 1000.0,
+				histogramQuantile(&h, 0.999) / 1000.0, histogramQuantile(&h, 1) / 1000.0);
+	}
+	printf("\n");
+}
+
+// packetRaw has to have one more byte after the packet
+// stamp is the kernel receive time, zero if not known
+void udpRecvPacket(int thread, char *packetRaw, ssize_t size, struct sockaddr_storage *addr, struct timespec *stamp) {
+	union packet *packet = (union packet *) packetRaw;
 	struct client *client;
-	socklen_t addr_len = sizeof(addr);
+	struct netAddrKey addrKey;
+	if (size <= 0) return;
+	netAddrKeyFrom(&addrKey, addr);
+	switch (packetRaw[0]) {
+		case PACKET_HELO:
+			packetRaw[size] = '\0';
+			if (packet->cHelo.version != PROT_VERSION) {
+				msg("Different version connection refused (%d instead %d)...", packet->cHelo.version, PROT_VERSION);
+				break;
+			}
+			packet->cHelo.name[NAME_LEN] = '\0';
+
+			pthread_mutex_lock(&clientsMutex);
+			if (clientsAddrLookup(&addrKey)) {
+				pthread_mutex_unlock(&clientsMutex);
+				msg("Second helo packet from the same address refused...");
+				break;
+			}
+			if (!(client = newClient(addr))) {
+				pthread_mutex_unlock(&clientsMutex);
+				break;
+			}
+			client->recvThread = thread;
+			client->recvPrevThread = thread;
+			client->recvPrevEpoch = 0;
+			client->recvThreadUsec = getUsec(usecZero);
+			udpRecvHelo(client, &packet->cHelo);
+			pthread_mutex_unlock(&clientsMutex);
+			msg("New client '%s' with id %d accepted...", client->name, client->id);
+			break;
+		case PACKET_DATA: {
+			ssize_t dataSize;
+			if (
+					(size < offsetof(struct packetClientData, data)) ||
+					((dataSize = fecDataSize(size, offsetof(struct packetClientData, data), packet->cData.fecCopies, 1)) < 0) ||
+					((packet->cData.codec == CODEC_PCM) && (dataSize != sizeof(packet->cData.block))) ||
+					!(client = clientsAddrLookup(&addrKey)) ||
+					(client->id != packet->cData.clientID)
+				) break;
+			if (!udpRecvOwner(client, thread)) break;
+			client->fecCopies = packet->cData.fecRequest;
+			driftAdd(&client->drift, client->buffer.readTime * MONO_BLOCK_SIZE, packet->cData.inputFrames);
+			for (size_t i = 0; i < packet->cData.fecCopies; i++) {
+				sample_t block[MONO_BLOCK_SIZE];
+				if (codecAdpcmDecode(packet->cData.data + dataSize + i * CODEC_ADPCM_SIZE(1), CODEC_ADPCM_SIZE(1), 1, block) &&
+						bufferWriteRecovered(&client->buffer, packet->cData.blockIndex - i - 1, block)) {
+					__sync_fetch_and_add(&fecStats.upRecovered, 1);
+				}
+			}
+			if (packet->cData.codec != CODEC_PCM) {
+				sample_t block[MONO_BLOCK_SIZE];
+				if (!codecDecode(packet->cData.codec, packet->cData.data, dataSize, 1, block)) break;
+				memcpy(packet->cData.block, block, sizeof(block));
+			}
+			__sync_fetch_and_add(&codecStats.upRaw, sizeof(packet->cData.block));
+			__sync_fetch_and_add(&codecStats.upCoded, dataSize);
+			udpRecvData(client, &packet->cData);
+			if (stamp->tv_sec) {
+				struct timespec now;
+				clock_gettime(CLOCK_REALTIME, &now);
+				histogramAdd(&recvLatency[thread], (now.tv_sec - stamp->tv_sec) * 1000000000ll + now.tv_nsec - stamp->tv_nsec);
+			}
+		} break;
+		case PACKET_KEY_PRESS:
+			if (
+					(size != sizeof(struct packetKeyPress)) ||
+					!(client = clientsAddrLookup(&addrKey)) ||
+					(client->id != packet->cKeyP.clientID) ||
+					(client->lastKeyPressIndex >= packet->cKeyP.keyPressIndex)
+				) break;
+			if (!udpRecvOwner(client, thread)) break;
+			client->lastKeyPress = packet->cKeyP.playBlockIndex;
+			client->lastKeyPressIndex = packet->cKeyP.keyPressIndex;
+			msg("Key '%c' pressed by '%s'...", packet->cKeyP.key, client->name);
+			client->lastPacketUsec = getUsec(usecZero);
+			pthread_mutex_lock(&clientsMutex);
+			udpRecvKeyPress(client, &packet->cKeyP);
+			pthread_mutex_unlock(&clientsMutex);
+			break;
+		case PACKET_VIEW:
+			if (
+					(size != sizeof(struct packetClientView)) ||
+					!(client = clientsAddrLookup(&addrKey)) ||
+					(client->id != packet->cView.clientID)
+				) break;
+			client->viewHeight = packet->cView.height;
+			break;
+		case PACKET_NOOP:
+			if (
+					(size != sizeof(struct packetClientNoop)) ||
+					!(client = clientsAddrLookup(&addrKey)) ||
+					(client->id != packet->cKeyP.clientID)
+				) break;
+			if (!udpRecvOwner(client, thread)) break;
+			client->lastPacketUsec = getUsec(usecZero);
+			client->restLatency = FLT_MAX;
+			client->restLatencyAvg = FLT_MAX;
+			client->mutedMic = true;
+			break;
+	}
+}
+
+void *udpReceiver(void *threadPtr) {
+	int thread = (intptr_t)threadPtr;
+	struct netRecvBatch *batch = malloc(sizeof(struct netRecvBatch));
+	int cnt;
+	if (!batch) {
+		msg("Cannot allocate memory for UDP receiver.");
+		udpState = UDP_CLOSED;
+		return NULL;
+	}
 
 	if (schedPolicy != SP_NICE) {
 		threadPriorityRealtime(1);
 	} else {
 		threadPriorityNice(1);
 	}
-
-	while ((size = recvfrom(udpSocket, packetRaw, sizeof(union packet), 0, (struct sockaddr *)&addr, &addr_len)) >= 0) {
-		switch (packetRaw[0]) {
-			case PACKET_HELO:
-				packetRaw[size] = '\0';
-				if (packet->cHelo.version != PROT_VERSION) {
-					msg("Different version connection refused (%d instead %d)...", packet->cHelo.version, PROT_VERSION);
-					break;
-				}
-				packet->cHelo.name[NAME_LEN] = '\0';
-
-				{
-					bool duplicate = false;
-					FOR_CLIENTS(client2) {
-						if (netAddrsEqual(&client2->addr, &addr)) {
-							msg("Second helo packet from the same address refused...");
-							duplicate = true;
-							break;
-						}
-					}
-					if (duplicate) break;
-				}
-				if (!(client = newClient())) {
-					break;
-				}
-				client->addr = addr;
-				udpRecvHelo(client, &packet->cHelo);
-				msg("New client '%s' with id %d accepted...", client->name, client->id);
-				break;
-			case PACKET_DATA:
-				if (
-						(size != sizeof(struct packetClientData)) ||
-						!(client = getClient(packet->cData.clientID)) ||
-						!netAddrsEqual(&addr, &client->addr)
-					) break;
-				udpRecvData(client, &packet->cData);
-				break;
-			case PACKET_KEY_PRESS:
-				if (
-						(size != sizeof(struct packetKeyPress)) ||
-						!(client = getClient(packet->cKeyP.clientID)) ||
-						!netAddrsEqual(&addr, &client->addr) ||
-						(client->lastKeyPressIndex >= packet->cKeyP.keyPressIndex)
-					) break;
-				client->lastKeyPress = packet->cKeyP.playBlockIndex;
-				client->lastKeyPressIndex = packet->cKeyP.keyPressIndex;
-				msg("Key '%c' pressed by '%s'...", packet->cKeyP.key, client->name);
-				client->lastPacketUsec = getUsec(usecZero);
-				udpRecvKeyPress(client, &packet->cKeyP);
-				break;
-			case PACKET_NOOP:
-				if (
-						(size != sizeof(struct packetClientNoop)) ||
-						!(client = getClient(packet->cKeyP.clientID)) ||
-						!netAddrsEqual(&addr, &client->addr)
-					) break;
-				client->lastPacketUsec = getUsec(usecZero);
-				client->restLatency = FLT_MAX;
-				client->restLatencyAvg = FLT_MAX;
-				client->mutedMic = true;
-				break;
+	threadPinCpu(SERVER_RECV_CPU >= 0 ? SERVER_RECV_CPU + thread : -1);
+
+	netRecvBatchInit(batch);
+#ifdef NET_URING
+	if (udpUring) batch->uring = &udpUringRecv[thread];
+#endif
+	while (((cnt = netRecvBatch(udpSockets[thread], batch)) >= 0) && (udpState == UDP_OPEN)) {
+		__sync_fetch_and_add(&udpRecvEpochs[thread], 1);
+		for (int i = 0; i < cnt; i++) {
+			udpRecvPacket(thread, batch->packets[i], batch->sizes[i], &batch->addrs[i], &batch->stamps[i]);
 		}
-		__sync_synchronize();
-		addr_len = sizeof(addr);
+		__sync_fetch_and_add(&udpRecvEpochs[thread], 1);
+		if (cnt > 0) {
+			__sync_fetch_and_add(&udpRecvBatchHist[cnt > 1 ? 32 - __builtin_clz(cnt - 1) : 0], 1);
+		}
+	}
+	if (udpState == UDP_OPEN) {
+		msg("UDP receiver error.");
+		udpState = UDP_CLOSED;
 	}
-	msg("UDP receiver error.");
-	udpState = UDP_CLOSED;
+	free(batch);
 	return NULL;
 }
 
+#undef CLIENTS_LIST
+#define CLIENTS_LIST statusClients
 #undef CLIENT_CONNECTED_FIELD
 #define CLIENT_CONNECTED_FIELD connectedStatus
 
+struct clientList statusClients; // snapshot for the current status
+
 int64_t getBlockUsec(bindex_t index) {
 	return (int64_t)index * 1000000 * MONO_BLOCK_SIZE / SAMPLE_RATE;
 }
 
+// sleeps until the given time of getUsec(usecZero) on absolute deadline, polling the clock for its last part;
+// CLOCK_MONOTONIC_RAW cannot be used for sleeping, so the deadline is converted to CLOCK_MONOTONIC just before
+void sleepUntilUsec(int64_t usecDeadline) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t usecSleep = usecDeadline - SERVER_BUSY_POLL_USEC - getUsec(usecZero);
+	if (usecSleep > 0) {
+		int64_t nsec = ts.tv_nsec + usecSleep * 1000;
+		ts.tv_sec += nsec / 1000000000;
+		ts.tv_nsec = nsec % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	}
+	while (getUsec(usecZero) < usecDeadline);
+}
+
 
 pthread_t statusThread;
-int statusLines = -1;
+bool statusStarted = false;
 bindex_t statusIndex = 0;
 void statusSleepPoint(bool last) {
 	static int cnt = 1;
@@ -466,9 +911,35 @@ void statusSleepPoint(bool last) {
 void statusAppend(struct client *client, char *s) {
 	while (*s) *client->statusPacketPos++ = *s++;
 }
+// starts a new line of the client's status, returns whether a packet was sent
+bool statusClientLineSep(struct client *client, bool last) {
+	if (client->statusLines < 0) { // the first line
+		client->statusLines = 0;
+	} else {
+		if (!last) statusAppend(client, "\n");
+		client->statusLines++;
+	}
+	if ((client->statusLines >= STATUS_LINES_PER_PACKET) || last) {
+		if (last) {
+			client->statusPacket.packetsCnt = client->statusPacket.packetIndex + 1;
+		}
+		udpSendPacket(client, &client->statusPacket, (void *)client->statusPacketPos - (void *)&client->statusPacket);
+		client->statusPacketPos = client->statusPacket.str;
+		client->statusPacket.packetIndex++;
+		client->statusLines = last ? -1 : 0;
+		return true;
+	}
+	return false;
+}
+char statusRows[MAX_CLIENTS][STATUS_WIDTH + 1]; // of participants in the current status
+void statusAppendRow(struct client *client, size_t row) {
+	statusClientLineSep(client, false);
+	statusAppend(client, row == client->statusRow ? "." : " ");
+	statusAppend(client, statusRows[row]);
+}
 void statusLineSep(bool last) { // calls usleep
-	if (statusLines < 0) { // init
-		statusLines = 0;
+	if (!statusStarted) { // init
+		statusStarted = true;
 		FOR_CLIENTS(client) {
 			client->statusPacket = (struct packetStatusStr) {
 				.type = PACKET_STATUS,
@@ -476,47 +947,46 @@ void statusLineSep(bool last) { // calls usleep
 				.packetIndex = 0,
 				.statusIndex = statusIndex};
 			client->statusPacketPos = client->statusPacket.str;
+			client->statusLines = -1;
 		}
 		statusIndex++;
-	} else {
-		if (!last) {
-			FOR_CLIENTS(client) {
-				statusAppend(client, "\n");
-			}
-		}
-		statusLines++;
 	}
-	if ((statusLines >= STATUS_LINES_PER_PACKET) || last) {
-		FOR_CLIENTS(client) {
-			if (last) {
-				client->statusPacket.packetsCnt = client->statusPacket.packetIndex + 1;
-			}
-			udpSendPacket(client, &client->statusPacket, (void *)client->statusPacketPos - (void *)&client->statusPacket);
-			client->statusPacketPos = client->statusPacket.str;
-			client->statusPacket.packetIndex++;
-		}
-		statusLines = last ? -1 : 0;
-		statusSleepPoint(last);
+	bool sent = false;
+	FOR_CLIENTS(client) {
+		if (statusClientLineSep(client, last)) sent = true;
 	}
+	if (last) statusStarted = false;
+	if (sent) statusSleepPoint(last);
 }
 
 void *statusWorker(void *nothing) {
 	if (schedPolicy == SP_NICE) {
 		threadPriorityNice(19);
 	}
+	threadPinCpu(SERVER_STATUS_CPU);
 	while (udpState == UDP_OPEN) {
 		__sync_synchronize();
 
 		{
-			for (int i = 0; i < MAX_CLIENTS; i++) {
-				if (clients[i] && clients[i]->connected) clients[i]->connectedStatus = true;
+			pthread_mutex_lock(&clientsMutex);
+			for (size_t i = 0; i < clientsList.cnt; i++) {
+				struct client *client = clientsList.items[i];
+				if (client->connected) client->connectedStatus = true;
 			}
 			__sync_synchronize();
-			for (int i = 0; i < MAX_CLIENTS; i++) {
-				if (clients[i] && !clients[i]->connected) clients[i]->connectedStatus = false;
+			for (size_t i = 0; i < clientsList.cnt; i++) {
+				struct client *client = clientsList.items[i];
+				if (!client->connected) client->connectedStatus = false;
 			}
+			clientsListPrune();
+			clientsListSnapshot(&statusClients);
+			pthread_mutex_unlock(&clientsMutex);
 			int connectedCnt = 0;
 			FOR_CLIENTS(c) connectedCnt++;
+			if (latencyDumpRequested) {
+				latencyDumpRequested = false;
+				latencyPrint(true);
+			}
 			if (connectedCnt == 0) {
 				statusSleepPoint(true);
 				continue;
@@ -532,8 +1002,12 @@ void *statusWorker(void *nothing) {
 
 		LN TXT("---------------------  left");
 
-		FOR_CLIENTS_ORDERED(client) {
-			char *s = str;
+		// participant rows are formatted once, each client gets only those fitting its terminal
+		size_t rowsCnt = 0;
+		struct client *worstClient = NULL, *loudestClient = NULL;
+		float worstLatency = 0, loudestLevel = -INFINITY;
+		FOR_CLIENTS(client) {
+			char *s = statusRows[rowsCnt];
 			s += sprintf(s, "%-10s", client->name);
 			if (client->aioLatency > 0) {
 				s += sprintf(s, "%3.0f+", client->aioLatency);
@@ -552,16 +1026,50 @@ void *statusWorker(void *nothing) {
 			ttyFormatSndLevel(&s, avg + client->dBAdj, peak + client->dBAdj);
 
 			if (statusLog) {
-				printf("%s\n", str);
+				printf("%s\n", statusRows[rowsCnt]);
 			}
 
-			LN {
-				TXT(C == client ? "." : " ");
-				TXT(str);
+			if ((client->aioLatency > 0) && (client->restLatencyAvg < 10000) && (client->aioLatency + client->restLatencyAvg > worstLatency)) {
+				worstLatency = client->aioLatency + client->restLatencyAvg;
+				worstClient = client;
 			}
+			if (!client->mutedMic && (avg + client->dBAdj > loudestLevel)) {
+				loudestLevel = avg + client->dBAdj;
+				loudestClient = client;
+			}
+			client->statusRow = rowsCnt++;
 		}
 		if (statusLog) { printf("\n"); }
 
+		{ // summary of all participants
+			size_t n = snprintf(str, sizeof(str), "%zu participants", rowsCnt);
+			if (worstClient && (n < sizeof(str))) n += snprintf(str + n, sizeof(str) - n, ", worst %.10s %.0f ms", worstClient->name, worstLatency);
+			if (loudestClient && (n < sizeof(str))) n += snprintf(str + n, sizeof(str) - n, ", loudest %.10s", loudestClient->name);
+		}
+
+		FOR_CLIENTS(C) {
+			// the window of rows, the client's own row is always included
+			size_t viewRows = statusViewRows(C);
+			if (viewRows > rowsCnt) viewRows = rowsCnt;
+			if (C->viewOffset > rowsCnt - viewRows) C->viewOffset = rowsCnt - viewRows;
+			size_t first = C->viewOffset, last = C->viewOffset + viewRows;
+			if (C->statusRow < first) {
+				last--;
+			} else if (C->statusRow >= last) {
+				first++;
+			}
+			if (C->statusRow < first) statusAppendRow(C, C->statusRow);
+			for (size_t i = first; i < last; i++) statusAppendRow(C, i);
+			if (C->statusRow >= last) statusAppendRow(C, C->statusRow);
+
+			char line[STATUS_WIDTH + 1] = " ";
+			if (viewRows < rowsCnt) snprintf(line, sizeof(line), " [%zu-%zu] ", first + 1, last);
+			size_t viewLen = strlen(line);
+			snprintf(line + viewLen, sizeof(line) - viewLen, "%s", str);
+			statusClientLineSep(C, false);
+			statusAppend(C, line);
+		}
+
 
 		/*
 		for (int i = 0; i < 15; i++) {
@@ -571,7 +1079,7 @@ void *statusWorker(void *nothing) {
 
 		LN TXT("---------------------  right");
 		LN TXT("");
-		LN TXT("[d/u] move down/up in list");
+		LN TXT("[d/u] move down/up in list        [</>] scroll list up/down");
 		LN TXT("[+/-] decrease/increase microphone volume by 2 dB");
 
 		LN {
@@ -588,6 +1096,8 @@ void *statusWorker(void *nothing) {
 			char *leadingTrackName = NULL;
 			if (metronome.enabled) {
 				leadingTrackName = "metronome ";
+			} else if (backing.started) {
+				leadingTrackName = "backing   ";
 			} else {
 				FOR_CLIENTS(client) {
 					if (client->isLeader) leadingTrackName = client->name;
@@ -629,13 +1139,32 @@ void *statusWorker(void *nothing) {
 			TXT(" beats per minute   [j/k] -/+ 2    [J/K] -/+ 20");
 		}
 
+		if (backing.track) {
+			size_t pos = backingPlayedPos();
+			float posSec = (float)pos * MONO_BLOCK_SIZE / SAMPLE_RATE;
+			sprintf(str, "%-10.10s %02d:%02d bar %3zu", backing.track->name, (int)posSec / 60, (int)posSec % 60,
+					(size_t)(pos / backingBarBlocks()) + 1);
+		} else {
+			sprintf(str, "-                         ");
+		}
+		LN {
+			TXT("Backing track:  ");
+			TXT(str);
+			if (backing.track) {
+				TXT("    [p] ");
+				TXT(backing.playing ? "stop" : "play");
+				TXT("  [P] rewind  [[/]] -/+ bar");
+			}
+		}
+
 
 		LN;
 		if (recording.enabled) {
 			float durSec = (blockIndex - recording.startTime) * MONO_BLOCK_SIZE / SAMPLE_RATE;
-			sprintf(str, "%02d:%02d  %s. leader    [r/R] stop", (int)durSec / 60, (int)durSec % 60, recording.inclLeader ? "incl" : "excl");
+			sprintf(str, "%02d:%02d  %s    [r/R/t] stop", (int)durSec / 60, (int)durSec % 60,
+					recording.stems ? "with stems  " : recording.inclLeader ? "incl. leader" : "excl. leader");
 		} else {
-			sprintf(str, "%19s    [r/R] start incl./excl. leading track", "");
+			sprintf(str, "%19s    [r/R] start incl./excl. leader  [t] stems", "");
 		}
 		LN {
 			TXT("Recording:     ");
@@ -649,36 +1178,469 @@ void *statusWorker(void *nothing) {
 		if (statusLog) printf("\n");
 
 		if (statusLog) {
-			printf("BLOCKS      play  lost  wait  skip  delay  lead       read    write\n");
-			FOR_CLIENTS_ORDERED(client) {
+			printf("BLOCKS      play  lost  wait  skip  delay target  loss  lead       read    write  fec    ppm\n");
+			FOR_CLIENTS(client) {
 				size_t play, lost, wait, skip;
 				ssize_t delay;
 				bufferSrvStatsReset(&client->buffer, &play, &lost, &wait, &skip, &delay);
-				printf("%-10s %5zu %5zu %5zu %5zu %6zd %5d   %8d %8d\n", client->name, play, lost, wait, skip, delay, client->leadingDelay,
-						client->buffer.readPos, client->buffer.writeLastPos);
+				printf("%-10s %5zu %5zu %5zu %5zu %6zd %6d %4.1f%% %5d   %8d %8d  %d/%d %6.1f\n", client->name, play, lost, wait, skip, delay,
+						bufferJitterTarget(&client->buffer), 100 * bufferLossRate(&client->buffer), client->leadingDelay,
+						client->buffer.readPos, client->buffer.writeLastPos,
+						fecCopiesForLoss(bufferLossRate(&client->buffer)), client->fecCopies, driftRate(&client->drift) * 1e6);
 			}
 			printf("\n");
+
+			printf("RECV BATCHES");
+			for (int i = 0; i < UDP_RECV_BATCH_BUCKETS; i++) {
+				size_t cnt = __sync_lock_test_and_set(&udpRecvBatchHist[i], 0);
+				if (i > 1) {
+					printf("  %d-%d: %zu", (1 << (i - 1)) + 1, 1 << i, cnt);
+				} else {
+					printf("  %d: %zu", 1 << i, cnt);
+				}
+			}
+			printf("\n");
+			{
+				size_t cnt = __sync_lock_test_and_set(&udpRecvForeignCnt, 0);
+				if (cnt) {
+					printf("RECV FOREIGN  %zu packets dropped, received by other than client's thread\n", cnt);
+				}
+				cnt = __sync_lock_test_and_set(&udpRecvHandoverCnt, 0);
+				if (cnt) {
+					printf("RECV HANDOVER %zu clients taken over by other receiver threads\n", cnt);
+				}
+			}
+			{
+				size_t upRaw     = __sync_lock_test_and_set(&codecStats.upRaw, 0);
+				size_t upCoded   = __sync_lock_test_and_set(&codecStats.upCoded, 0);
+				size_t downRaw   = __sync_lock_test_and_set(&codecStats.downRaw, 0);
+				size_t downCoded = __sync_lock_test_and_set(&codecStats.downCoded, 0);
+				printf("CODEC RATIO   up %5.2f   down %5.2f\n",
+						upCoded   ? (float)upRaw   / upCoded   : 1.0,
+						downCoded ? (float)downRaw / downCoded : 1.0);
+				printf("FEC RECOVERED up %zu blocks\n", __sync_lock_test_and_set(&fecStats.upRecovered, 0));
+			}
+
+			{
+				static struct recorderStats prev;
+				struct recorderStats *stats = &recordingEncoders.stats;
+				struct recorderStats cur = *stats;
+				size_t ringMax = __sync_lock_test_and_set(&stats->ringMax, 0);
+				if (recording.recorder || (cur.rawBytes != prev.rawBytes) || (cur.dropped != prev.dropped)) {
+					size_t raw = cur.rawBytes - prev.rawBytes, coded = cur.codedBytes - prev.codedBytes;
+					printf("RECORDING     cpu %5.2f %%   ratio %5.2f   ring max %5.1f %%   dropped %zu blocks\n",
+							(float)(cur.encodeNsec - prev.encodeNsec) / 1000 / getBlockUsec(BLOCKS_PER_SRV_STAT) * 100,
+							coded ? (float)raw / coded : 1.0,
+							(float)ringMax / RECORDER_RING_SIZE * 100,
+							cur.dropped - prev.dropped);
+				}
+				prev = cur;
+			}
+
+			if (backing.track) {
+				static size_t prevUnderruns = 0;
+				size_t underruns = backing.track->underruns;
+				printf("BACKING TRACK underruns %zu blocks\n", underruns - prevUnderruns);
+				prevUnderruns = underruns;
+			}
+
+			{
+				size_t used, allocated, pageSize, sUsed, sAllocated, sPageSize;
+				bufferPoolStats(&used, &allocated, &pageSize);
+				sbufferPoolStats(&sUsed, &sAllocated, &sPageSize);
+				printf("BUFFER PAGES  mono %zu/%zu (%.1f MB)   stereo %zu/%zu (%.1f MB)\n",
+						used, allocated, (float)allocated * pageSize / (1 << 20),
+						sUsed, sAllocated, (float)sAllocated * sPageSize / (1 << 20));
+			}
+			printf("\n");
+
+			latencyPrint(false);
 		}
 	}
 	return NULL;
 }
 
+
+// --- metrics export ---
+
+#undef CLIENTS_LIST
+#define CLIENTS_LIST metricsClients
+#undef CLIENT_CONNECTED_FIELD
+#define CLIENT_CONNECTED_FIELD connected
+
+struct clientList metricsClients; // snapshot for the current scrape
+
+pthread_t metricsThread;
+
+// values of a client read at once, before rendering
+struct metricsClient {
+	int id;
+	char name[NAME_LEN + 1];
+	double aioLatency, restLatency; // ms
+	double delay, target, leadingDelay; // blocks
+	double play, lost, wait, skip;
+	double lossRate, fecCopies, drift;
+	double sendErrors;
+} metricsSnapshot[MAX_CLIENTS];
+
+void metricsRender(FILE *out) {
+	clientsListSnapshot(&metricsClients);
+	size_t cnt = 0;
+	FOR_CLIENTS(client) {
+		struct metricsClient *m = &metricsSnapshot[cnt++];
+		size_t play, lost, wait, skip;
+		bufferSrvStats(&client->buffer, &play, &lost, &wait, &skip);
+		m->id = client->id;
+		strcpy(m->name, client->name);
+		for (char *c = m->name + strlen(m->name); (c > m->name) && (c[-1] == ' '); *--c = '\0'); // padded
+		m->aioLatency = client->aioLatency > 0 ? client->aioLatency : NAN;
+		m->restLatency = client->restLatencyAvg < 10000 ? client->restLatencyAvg : NAN;
+		m->delay = client->buffer.writeLastPos - client->buffer.readPos + 1;
+		m->target = bufferJitterTarget(&client->buffer);
+		m->leadingDelay = client->leadingDelay;
+		m->play = play;
+		m->lost = lost;
+		m->wait = wait;
+		m->skip = skip;
+		m->lossRate = bufferLossRate(&client->buffer);
+		m->fecCopies = client->fecCopies;
+		m->drift = driftRate(&client->drift);
+		m->sendErrors = client->sendErrors;
+	}
+	struct histogram latency[LATENCY_STAGES];
+	latencyMerge(latency);
+
+#define CLIENTS_METRIC(NAME, TYPE, HELP, FIELD) \
+	metricsHeader(out, NAME, TYPE, HELP); \
+	for (size_t i = 0; i < cnt; i++) { \
+		fprintf(out, NAME "{id=\"%d\",name=\"", metricsSnapshot[i].id); \
+		metricsLabel(out, metricsSnapshot[i].name); \
+		fputs("\"}", out); \
+		metricsValue(out, metricsSnapshot[i].FIELD); \
+	}
+
+	CLIENTS_METRIC("vichrr_client_aio_latency_ms",          "gauge",   "Latency of audio input and output reported by the client.", aioLatency);
+	CLIENTS_METRIC("vichrr_client_rest_latency_ms",         "gauge",   "Average latency of network and buffers.", restLatency);
+	CLIENTS_METRIC("vichrr_client_buffer_delay_blocks",     "gauge",   "Blocks in the server buffer of the client.", delay);
+	CLIENTS_METRIC("vichrr_client_buffer_target_blocks",    "gauge",   "Target delay of the buffer given by the jitter model.", target);
+	CLIENTS_METRIC("vichrr_client_leading_delay_blocks",    "gauge",   "Delay of the leading track sent to the client.", leadingDelay);
+	CLIENTS_METRIC("vichrr_client_played_blocks_total",     "counter", "Blocks read from the buffer of the client.", play);
+	CLIENTS_METRIC("vichrr_client_lost_blocks_total",       "counter", "Blocks missing in the buffer when read.", lost);
+	CLIENTS_METRIC("vichrr_client_wait_blocks_total",       "counter", "Blocks of waiting for data.", wait);
+	CLIENTS_METRIC("vichrr_client_skip_blocks_total",       "counter", "Blocks skipped to lower the delay.", skip);
+	CLIENTS_METRIC("vichrr_client_loss_ratio",              "gauge",   "Average rate of lost blocks.", lossRate);
+	CLIENTS_METRIC("vichrr_client_fec_copies",              "gauge",   "Redundant copies of blocks requested by the client.", fecCopies);
+	CLIENTS_METRIC("vichrr_client_input_drift_ratio",       "gauge",   "Relative drift of the input clock of the client.", drift);
+	CLIENTS_METRIC("vichrr_client_send_errors_total",       "counter", "Failed sending of packets to the client.", sendErrors);
+#undef CLIENTS_METRIC
+
+	metricsHeader(out, "vichrr_clients", "gauge", "Connected clients.");
+	fprintf(out, "vichrr_clients");
+	metricsValue(out, cnt);
+	metricsHeader(out, "vichrr_mixer_ticks_total", "counter", "Ticks of the sound mixer.");
+	fprintf(out, "vichrr_mixer_ticks_total");
+	metricsValue(out, blockIndex);
+	metricsHeader(out, "vichrr_mixer_ticks_caught_up_total", "counter", "Ticks processed late back to back.");
+	fprintf(out, "vichrr_mixer_ticks_caught_up_total");
+	metricsValue(out, mixerTickStats.caughtUp);
+	metricsHeader(out, "vichrr_mixer_ticks_dropped_total", "counter", "Ticks dropped from the timeline of the mixer.");
+	fprintf(out, "vichrr_mixer_ticks_dropped_total");
+	metricsValue(out, mixerTickStats.dropped);
+	metricsHeader(out, "vichrr_recording_encode_seconds_total", "counter", "CPU time of compressing recordings.");
+	fprintf(out, "vichrr_recording_encode_seconds_total");
+	metricsValue(out, recordingEncoders.stats.encodeNsec * 1e-9);
+	metricsHeader(out, "vichrr_recording_raw_bytes_total", "counter", "Recorded audio data before compression.");
+	fprintf(out, "vichrr_recording_raw_bytes_total");
+	metricsValue(out, recordingEncoders.stats.rawBytes);
+	metricsHeader(out, "vichrr_recording_written_bytes_total", "counter", "Recorded audio data written to files.");
+	fprintf(out, "vichrr_recording_written_bytes_total");
+	metricsValue(out, recordingEncoders.stats.codedBytes);
+	metricsHeader(out, "vichrr_recording_dropped_blocks_total", "counter", "Recorded blocks dropped on the full ring of the writer.");
+	fprintf(out, "vichrr_recording_dropped_blocks_total");
+	metricsValue(out, recordingEncoders.stats.dropped);
+
+	const double quantiles[] = {0.5, 0.99, 0.999, 1};
+	metricsHeader(out, "vichrr_latency_seconds", "summary", "Latencies of stages of the mixer tick and of receiving.");
+	for (int s = 0; s < LATENCY_STAGES; s++) {
+		for (size_t q = 0; q < sizeof(quantiles) / sizeof(*quantiles); q++) {
+			fprintf(out, "vichrr_latency_seconds{stage=\"%s\",quantile=\"%g\"}", latencyStageNames[s], quantiles[q]);
+			metricsValue(out, histogramQuantile(&latency[s], quantiles[q]) * 1e-9);
+		}
+		fprintf(out, "vichrr_latency_seconds_sum{stage=\"%s\"}", latencyStageNames[s]);
+		metricsValue(out, latency[s].sum * 1e-9);
+		fprintf(out, "vichrr_latency_seconds_count{stage=\"%s\"}", latencyStageNames[s]);
+		metricsValue(out, histogramCount(&latency[s]));
+	}
+}
+
+void *metricsWorker(void *sfdPtr) {
+	int sfd = (intptr_t)sfdPtr;
+	if (schedPolicy == SP_NICE) {
+		threadPriorityNice(19);
+	}
+	threadPinCpu(SERVER_STATUS_CPU);
+	while ((udpState == UDP_OPEN) && metricsServe(sfd, &metricsRender));
+	return NULL;
+}
+
 void sigintHandler(int signum) {
 	exit(0);
 }
 
+#undef CLIENTS_LIST
+#define CLIENTS_LIST mainClients
 #undef CLIENT_CONNECTED_FIELD
 #define CLIENT_CONNECTED_FIELD connectedMain
 
+struct clientList mainClients; // snapshot for the current tick
+
+// disconnected clients, whose buffers can still be written by receiver threads which looked them up before
+struct {
+	size_t cnt;
+	struct client *items[MAX_CLIENTS];
+} releasingClients;
+
+// stops mixing the client, which has to be already disconnected;
+// its buffer is released later by mainClientsRelease, as receiver threads may still be writing to it
+void mainClientDisconnect(struct client *client) {
+	client->bufferReleasing = true;
+	__sync_synchronize();
+	client->connectedMain = false;
+	__sync_synchronize();
+	for (int i = 0; i < SERVER_RECV_THREADS; i++) {
+		client->releaseEpochs[i] = udpRecvEpochs[i];
+	}
+	releasingClients.items[releasingClients.cnt++] = client;
+}
+
+// releases buffers of disconnected clients after all receiver threads finished batches being processed on disconnecting
+void mainClientsRelease() {
+	for (size_t i = 0; i < releasingClients.cnt; ) {
+		struct client *client = releasingClients.items[i];
+		bool writing = false;
+		for (int t = 0; t < SERVER_RECV_THREADS; t++) {
+			unsigned epoch = client->releaseEpochs[t];
+			writing |= (epoch & 1) && (udpRecvEpochs[t] == epoch);
+		}
+		if (writing) {
+			i++;
+			continue;
+		}
+		__sync_synchronize();
+		bufferRelease(&client->buffer);
+		__sync_synchronize();
+		client->bufferReleasing = false;
+		releasingClients.items[i] = releasingClients.items[--releasingClients.cnt];
+	}
+}
+
+// --- parallel mixing ---
+
+struct mixerWorker {
+	mixacc_t mixedBlock[STEREO_BLOCK_SIZE] MIX_ALIGNED; // partial mix of worker's clients
+	struct client *leader;
+	int maxClientLeadingDelay;
+	sample_t leadingBlock[STEREO_BLOCK_SIZE];
+	sample_t outBlock[STEREO_BLOCK_SIZE]; // before coding
+	struct netBatch batch;
+	uint64_t mixNsec; // duration of partial mixing in the last tick
+} mixerWorkers[WORKER_POOL_MAX_THREADS];
+
+struct workerPool mixerPool;
+struct client *mixerClients[MAX_CLIENTS]; // connected clients in the current tick
+size_t mixerClientsCnt;
+bool mixerLeadingEnabled;
+
+void mixerThreadInit() {
+	if (schedPolicy != SP_NICE) {
+		threadPriorityRealtime(2);
+	}
+}
+
+void mixerSendFailed(void *clientPtr, int err) {
+	struct client *client = clientPtr;
+	__sync_fetch_and_add(&client->sendErrors, 1);
+	msg("Sending to client %d '%s' failed, disconnected...", client->id, client->name);
+	client->connected = false;
+}
+
+#define FOR_WORKER_CLIENTS(CLIENT, WORKER, WORKERS_CNT) \
+	for (size_t CLIENT##_INDEX = mixerClientsCnt * (WORKER) / (WORKERS_CNT); CLIENT##_INDEX < mixerClientsCnt * ((WORKER) + 1) / (WORKERS_CNT); CLIENT##_INDEX++) \
+	for (struct client *CLIENT = mixerClients[CLIENT##_INDEX]; CLIENT; CLIENT = NULL)
+
+// phase 1: reading from buffers, spatialization and partial mixing
+void mixerReadJob(void *none, size_t worker, size_t workersCnt) {
+	struct mixerWorker *w = &mixerWorkers[worker];
+	uint64_t readNsec = 0, surroundNsec = 0, mixNsec = 0;
+	uint64_t t0 = histogramNsec();
+	mixClear(w->mixedBlock);
+	w->leader = NULL;
+	FOR_WORKER_CLIENTS(client, worker, workersCnt) {
+		sample_t *clientBlock = client->lastReadBlock;
+		sample_t *block = bufferReadNext(&client->buffer);
+		uint64_t t1 = histogramNsec();
+		surroundFilter(&client->surroundCtx, block, clientBlock);
+		uint64_t t2 = histogramNsec();
+		if (client->isLeader) {
+			w->leader = client;
+		} else {
+			mixAdd(w->mixedBlock, clientBlock);
+		}
+		uint64_t t3 = histogramNsec();
+		readNsec += t1 - t0;
+		surroundNsec += t2 - t1;
+		mixNsec += t3 - t2;
+		t0 = t3;
+	}
+	histogramAdd(&mixerLatency[worker][LATENCY_READ], readNsec);
+	histogramAdd(&mixerLatency[worker][LATENCY_SURROUND], surroundNsec);
+	w->mixNsec = mixNsec; // recorded by the main thread after merging
+}
+
+// phase 2: per-listener mixes and sending
+void mixerSendJob(void *none, size_t worker, size_t workersCnt) {
+	struct mixerWorker *w = &mixerWorkers[worker];
+	uint64_t t0 = histogramNsec();
+	const mixacc_t *mixedBlock = mixerWorkers[0].mixedBlock;
+	bool leadingEnabled = mixerLeadingEnabled;
+	size_t downRaw = 0, downCoded = 0;
+	w->maxClientLeadingDelay = 0;
+	FOR_WORKER_CLIENTS(client, worker, workersCnt) {
+		if (client->muted) continue;
+		sample_t *selfBlock = NULL;
+		sample_t *leadingBlock = NULL;
+
+		if (!(leadingEnabled && client->isLeader) && !client->hearSelf) {
+			selfBlock = client->lastReadBlock; // all except leader and self
+		}
+
+		if (leadingEnabled && (!client->isLeader || client->hearSelf)) {
+			int delay;
+			if (client->restLatencyAvg != FLT_MAX) {
+				delay = ((client->aioLatency > 0 ? client->aioLatency : 20) + client->restLatencyAvg) * SAMPLE_RATE / 1000 / MONO_BLOCK_SIZE;
+			} else {
+				delay = 0;
+			}
+			if (w->maxClientLeadingDelay < delay) w->maxClientLeadingDelay = delay;
+			bool fadeIn = false, fadeOut = false;
+			if (client->leadingDelay < 0) {
+				client->leadingDelay = delay;
+				fadeIn = true;
+			} else {
+				if ((float)abs(client->leadingDelay - delay) * MONO_BLOCK_SIZE / SAMPLE_RATE * 1000 > 5) {
+					fadeOut = true;
+					delay = client->leadingDelay;
+					client->leadingDelay = -1;
+				} else {
+					delay = client->leadingDelay;
+				}
+			}
+			leadingBlock = sbufferReadTo(&leading.buffer, blockIndex + delay, fadeIn, fadeOut, w->leadingBlock); // all except self
+		}
+
+		struct packetServerData *packet = &client->dataPacket;
+		size_t size = offsetof(struct packetServerData, data) + sizeof(packet->block);
+		packet->type = PACKET_DATA;
+		packet->codec = CODEC_PCM;
+		packet->blockIndex = blockIndex;
+		if (client->codec == CODEC_PCM) {
+			mixOutput(&limiter, mixedBlock, selfBlock, leadingBlock, packet->block);
+		} else {
+			mixOutput(&limiter, mixedBlock, selfBlock, leadingBlock, w->outBlock);
+			size_t codedSize = codecEncode(client->codec, w->outBlock, 2, packet->data);
+			if (codedSize) {
+				packet->codec = client->codec;
+				size = offsetof(struct packetServerData, data) + codedSize;
+			} else {
+				memcpy(packet->block, w->outBlock, sizeof(packet->block));
+			}
+		}
+		downRaw += sizeof(packet->block);
+		downCoded += size - offsetof(struct packetServerData, data);
+
+		packet->fecRequest = fecCopiesForLoss(bufferLossRate(&client->buffer));
+		packet->fecCopies = 0;
+		packet->inputDrift = driftRate(&client->drift);
+		if (client->fecCopies) {
+			fecSenderAdd(&client->fec, client->codec == CODEC_PCM ? packet->block : w->outBlock, 2, blockIndex);
+			packet->fecCopies = fecSenderPut(&client->fec, 2, blockIndex, client->fecCopies, (uint8_t *)packet + size);
+			size += packet->fecCopies * CODEC_ADPCM_SIZE(2);
+		}
+		netBatchAdd(udpSocket, &w->batch, &client->addr, packet, size, client, &mixerSendFailed);
+	}
+	netBatchFlush(udpSocket, &w->batch, &mixerSendFailed);
+	__sync_fetch_and_add(&codecStats.downRaw, downRaw);
+	__sync_fetch_and_add(&codecStats.downCoded, downCoded);
+	histogramAdd(&mixerLatency[worker][LATENCY_SEND], histogramNsec() - t0);
+}
+
+#undef FOR_WORKER_CLIENTS
+
 #define ERR(...) {msg(__VA_ARGS__); return 1; }
-int main() {
+int main(int argc, char **argv) {
+	bool useUring = false, useSqpoll = false;
+	const char *backingFilename = NULL;
+	for (int opt; (opt = getopt(argc, argv, "usb:")) != -1; ) {
+		switch (opt) {
+			case 'b':
+				backingFilename = optarg;
+				break;
+			case 's':
+				useSqpoll = true; // fall through
+			case 'u':
+				useUring = true;
+				break;
+			default:
+				printf("Usage: %s [-u] [-s] [-b FILE]\n", argv[0]);
+				printf("  -u       use io_uring network backend\n");
+				printf("  -s       use io_uring with kernel submission polling threads\n");
+				printf("  -b FILE  backing track to be played as leading track, WAV or raw stereo, 16 bits, " STR(SAMPLE_RATE) " Hz\n");
+				return 1;
+		}
+	}
+
 	signal(SIGINT, sigintHandler);
+	signal(SIGUSR1, sigusr1Handler);
 	setlinebuf(stdout);
 	usecZero = getUsec(0);
+	if (backingFilename) {
+		if (!(backing.track = backingTrackOpen(backingFilename, &backingThreadInit))) return 1;
+		float durSec = (float)backingTrackBlocks(backing.track) * MONO_BLOCK_SIZE / SAMPLE_RATE;
+		printf("Using backing track '%s', %02d:%02d.\n", backing.track->name, (int)durSec / 60, (int)durSec % 60);
+	}
 	netInit();
-	udpSocket = netOpenPort(STR(UDP_PORT));
-	if (udpSocket < 0) {
-		ERR("Cannot open port.");
+	for (int i = 0; i < SERVER_RECV_THREADS; i++) {
+		udpSockets[i] = netOpenPort(STR(UDP_PORT), SERVER_RECV_THREADS > 1);
+		if (udpSockets[i] < 0) {
+			ERR("Cannot open port.");
+		}
+	}
+	udpSocket = udpSockets[0];
+	for (int i = 0; i < SERVER_RECV_THREADS; i++) {
+		if (!netRecvTimestamps(udpSockets[i])) {
+			printf("Kernel receive timestamps not available, receive latency will not be measured.\n");
+			break;
+		}
+	}
+#ifdef SERVER_RECV_STEER_CPU
+	if ((SERVER_RECV_THREADS > 1) && !netSteerReusePortByCpu(udpSocket, SERVER_RECV_THREADS)) {
+		printf("Cannot steer datagrams by cpu, using address hash.\n");
+	}
+#endif
+	if (useUring) {
+#ifdef NET_URING
+		udpUring = netUringSendInit(&udpUringSend, MAX_CLIENTS, useSqpoll);
+		for (int i = 0; udpUring && (i < SERVER_RECV_THREADS); i++) {
+			udpUring = netUringRecvInit(&udpUringRecv[i], udpSockets[i], useSqpoll);
+		}
+		if (udpUring) {
+			printf("Using io_uring network backend%s.\n", useSqpoll ? " with submission polling" : "");
+		} else {
+			printf("Cannot initialize io_uring, using classic network backend.\n");
+		}
+#else
+		printf("io_uring not supported, using classic network backend.\n");
+#endif
 	}
 
 	udpState = UDP_OPEN;
@@ -697,14 +1659,47 @@ int main() {
 	}
 
 
-	if (pthread_create(&udpThread, NULL, &udpReceiver, NULL) != 0) ERR("Cannot create thread.");
+	{
+		long threadsCnt = MIXER_THREADS;
+		if (threadsCnt <= 0) threadsCnt = sysconf(_SC_NPROCESSORS_ONLN);
+		threadsCnt = workerPoolInit(&mixerPool, threadsCnt, &mixerThreadInit);
+		printf("Using %ld thread%s for sound mixing.\n", threadsCnt, threadsCnt > 1 ? "s" : "");
+		for (size_t i = 0; i < WORKER_POOL_MAX_THREADS; i++) {
+			netBatchInit(&mixerWorkers[i].batch);
+#ifdef NET_URING
+			if (udpUring) mixerWorkers[i].batch.uring = &udpUringSend;
+#endif
+		}
+	}
+
+	if (RECORDER_FLAC) {
+		size_t threadsCnt = recorderEncodersInit(&recordingEncoders, RECORDER_THREADS, &recordingEncoderInit);
+		printf("Using %zu thread%s for compressing recordings.\n", threadsCnt, threadsCnt > 1 ? "s" : "");
+	} else {
+		recorderEncodersInit(&recordingEncoders, 1, NULL);
+	}
+
+	if (!bufferPoolGrow() || !sbufferPoolGrow()) ERR("Cannot allocate memory for buffers.");
+
+	for (intptr_t i = 0; i < SERVER_RECV_THREADS; i++) {
+		if (pthread_create(&udpThreads[i], NULL, &udpReceiver, (void *)i) != 0) ERR("Cannot create thread.");
+	}
 	if (pthread_create(&statusThread, NULL, &statusWorker, NULL) != 0) ERR("Cannot create thread.");
+	if (SERVER_METRICS_PORT > 0) {
+		int sfd = metricsOpen(SERVER_METRICS_PORT);
+		if (sfd < 0) {
+			printf("Cannot open metrics port %d, metrics will not be exported.\n", SERVER_METRICS_PORT);
+		} else if (pthread_create(&metricsThread, NULL, &metricsWorker, (void *)(intptr_t)sfd) != 0) {
+			ERR("Cannot create thread.");
+		}
+	}
 
 	metronome.enabled = false;
 	metronome.beatsPerMinute = METR_DEFAULT_BPM;
 	metronome.beatsPerBar = METR_DEFAULT_BPB;
 
 	leading.delay = 0;
+	mixLimiterInit(&limiter);
 	// leading.delay = (int64_t) METR_DELAY_MSEC * SAMPLE_RATE / 1000 / MONO_BLOCK_SIZE; // TODO dynamic adjustment
 
 	int64_t usecFreeSum = 0;
@@ -713,7 +1708,11 @@ int main() {
 	int64_t usecWakeDelayMax = 0;
 	int64_t usecLoadMax = 0;
 	int64_t usecAwaken = 0;
-	struct packetServerData packet = { .type = PACKET_DATA };
+	int64_t usecShift = 0;   // of the timeline of ticks after dropping missed ones
+	size_t catchUpTicks = 0, droppedTicks = 0;
+	bool late = false;
+
+	threadPinCpu(SERVER_MIXER_CPU);
 
 
 	printf("\n");
@@ -721,94 +1720,91 @@ int main() {
 
 	while (udpState == UDP_OPEN) {
 		__sync_synchronize();
-
-		for (int i = 0; i < MAX_CLIENTS; i++) {
-			if (clients[i] && clients[i]->connected) clients[i]->connectedMain = true;
+		uint64_t nsecTick = histogramNsec();
+
+		clientsListSnapshot(&mainClients);
+		for (size_t i = 0; i < mainClients.cnt; i++) {
+			struct client *client = mainClients.items[i];
+			if (client->connected) {
+				client->connectedMain = true;
+			} else if (client->connectedMain) {
+				mainClientDisconnect(client);
+			}
 		}
+		mainClientsRelease();
 
 		// sound mixing [
 
-		sample_t mixedBlock[STEREO_BLOCK_SIZE];
-		sample_t *block = packet.block;
-		memset(mixedBlock, 0, STEREO_BLOCK_SIZE * sizeof(sample_t));
-		packet.blockIndex = blockIndex;
-		bool leadingEnabled = metronome.enabled && metronome.lastBeatTime;
-		FOR_CLIENTS(client) {
-			sample_t *clientBlock = client->lastReadBlock;
-			surroundFilter(&client->surroundCtx, bufferReadNext(&client->buffer), clientBlock);
-			if (client->isLeader) {
+		mixerClientsCnt = 0;
+		FOR_CLIENTS(client) mixerClients[mixerClientsCnt++] = client;
+		size_t workersCnt = (mixerClientsCnt + MIXER_CLIENTS_PER_THREAD - 1) / MIXER_CLIENTS_PER_THREAD;
+
+		workersCnt = workerPoolRun(&mixerPool, workersCnt, &mixerReadJob, NULL);
+
+		uint64_t nsecMerge = histogramNsec();
+		mixacc_t *mixedBlock = mixerWorkers[0].mixedBlock;
+		bool leadingEnabled = (metronome.enabled && metronome.lastBeatTime) || backing.started;
+		for (size_t w = 0; w < workersCnt; w++) {
+			if (w > 0) {
+				mixAddAcc(mixedBlock, mixerWorkers[w].mixedBlock);
+			}
+			struct client *client = mixerWorkers[w].leader;
+			if (client) {
 				leadingEnabled = true;
 				bool delayChange = leading.delay != leading.newDelay;
-				sbufferWrite(&leading.buffer, blockIndex + leading.delay, clientBlock, true); // leading.fadeIn, delayChange XXX
+				sbufferWrite(&leading.buffer, blockIndex + leading.delay, client->lastReadBlock, true); // leading.fadeIn, delayChange XXX
 				if (delayChange) {
 					leading.delay = leading.newDelay;
 					leading.fadeIn = true;
 				}
-			} else {
-				for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++) {
-					mixedBlock[i] += clientBlock[i];
-				}
 			}
 		}
+		mixLimiterUpdate(&limiter, mixedBlock);
+		mixerLeadingEnabled = leadingEnabled;
+		mixerWorkers[0].mixNsec += histogramNsec() - nsecMerge;
+		for (size_t w = 0; w < workersCnt; w++) {
+			histogramAdd(&mixerLatency[w][LATENCY_MIX], mixerWorkers[w].mixNsec);
+		}
 
-		int maxClientLeadingDelay = 0;
-		FOR_CLIENTS(client) {
-			if (client->muted) continue;
-			sample_t *clientBlock = client->lastReadBlock;
-			sample_t *leadingBlock = NULL;
-
-			for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++)
-				block[i] = mixedBlock[i]; // all except leader
-
-			if (!(leadingEnabled && client->isLeader) && !client->hearSelf) {
-				for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++)
-					block[i] -= clientBlock[i]; // all except leader and self
-			}
-
-			if (leadingEnabled && (!client->isLeader || client->hearSelf)) {
-				int delay;
-				if (client->restLatencyAvg != FLT_MAX) {
-					delay = ((client->aioLatency > 0 ? client->aioLatency : 20) + client->restLatencyAvg) * SAMPLE_RATE / 1000 / MONO_BLOCK_SIZE;
-				} else {
-					delay = 0;
-				}
-				if (maxClientLeadingDelay < delay) maxClientLeadingDelay = delay;
-				bool fadeIn = false, fadeOut = false;
-				if (client->leadingDelay < 0) {
-					client->leadingDelay = delay;
-					fadeIn = true;
-				} else {
-					if ((float)abs(client->leadingDelay - delay) * MONO_BLOCK_SIZE / SAMPLE_RATE * 1000 > 5) {
-						fadeOut = true;
-						delay = client->leadingDelay;
-						client->leadingDelay = -1;
-					} else {
-						delay = client->leadingDelay;
-					}
-				}
-				leadingBlock = sbufferRead(&leading.buffer, blockIndex + delay, fadeIn, fadeOut);
-
-				for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++)
-					block[i] += leadingBlock[i]; // all except self
-			}
+#ifdef NET_URING
+		if (udpUring) netUringSendReap(&udpUringSend, true, &mixerSendFailed); // packets of the previous tick are to be rewritten
+#endif
+		workerPoolRun(&mixerPool, workersCnt, &mixerSendJob, NULL);
+#ifdef NET_URING
+		if (udpUring) netUringSendSubmit(&udpUringSend);
+#endif
 
-			ssize_t err = udpSendPacket(client, &packet, sizeof(struct packetServerData));
-			// ssize_t err = sendto(udpSocket, &packet, sizeof(struct packetServerData), 0,
-			// 	(struct sockaddr *)&clients[c]->addr, sizeof(struct sockaddr_storage));
-			if (err < 0) {
-				msg("Sending to client %d '%s' failed, disconnected...", client->id, client->name);
-				client->connected = false;
+		int maxClientLeadingDelay = 0;
+		for (size_t w = 0; w < workersCnt; w++) {
+			if (maxClientLeadingDelay < mixerWorkers[w].maxClientLeadingDelay) {
+				maxClientLeadingDelay = mixerWorkers[w].maxClientLeadingDelay;
 			}
 		}
 
 		if (recording.enabled) {
+			uint64_t nsecRecord = histogramNsec();
+			sample_t recordedBlock[STEREO_BLOCK_SIZE];
+			sample_t *leadingBlock = NULL;
 			if (leadingEnabled && recording.inclLeader) {
-				sample_t *leadingBlock = sbufferRead(&leading.buffer, blockIndex, false, false);
-				for (size_t i = 0; i < STEREO_BLOCK_SIZE; i++)
-					mixedBlock[i] += leadingBlock[i];
+				leadingBlock = sbufferRead(&leading.buffer, blockIndex, false, false);
 			}
-			fwrite(mixedBlock, sizeof(mixedBlock), 1, recording.file);
+			mixOutput(&limiter, mixedBlock, NULL, leadingBlock, recordedBlock);
+			recorderPut(recording.recorder, blockIndex, RECORDING_TRACK_MIX, "", 2, recordedBlock);
+			if (recording.stems) {
+				if (leadingEnabled) {
+					if (!leadingBlock) leadingBlock = sbufferRead(&leading.buffer, blockIndex, false, false);
+					recorderPut(recording.recorder, blockIndex, RECORDING_TRACK_LEADING, "leading", 2, leadingBlock);
+				}
+				FOR_CLIENTS(client) {
+					recorderPut(recording.recorder, blockIndex, (uint32_t)client->session << 16 | client->id, client->name, 1, client->surroundCtx.prevMonoBlock); // as read from the buffer
+				}
+			}
+			histogramAdd(&mixerLatency[0][LATENCY_RECORD], histogramNsec() - nsecRecord);
+		} else if (recording.recorder) {
+			recorderStop(recording.recorder);
+			recording.recorder = NULL;
 		}
+		sbufferReleaseBefore(&leading.buffer, blockIndex);
 
 		if (leadingEnabled) {
 			if (leading.delay < maxClientLeadingDelay) {
@@ -822,6 +1818,7 @@ int main() {
 		// ] end of sound mixing
 
 		if (metronome.enabled) {
+			uint64_t nsecMetronome = histogramNsec();
 			leading.delay = leading.newDelay;
 			bindex_t nextBeatTime;
 			if (metronome.lastBeatTime == 0) {
@@ -842,6 +1839,7 @@ int main() {
 					metronome.lastBeatBarIndex = (metronome.lastBeatBarIndex + 1) % metronome.beatsPerBar;
 					mainBeat = metronome.lastBeatBarIndex == 0;
 				}
+				sample_t beatBlock[STEREO_BLOCK_SIZE];
 				const sample_t *beat;
 				size_t beatSize;
 				if (mainBeat) {
@@ -855,38 +1853,77 @@ int main() {
 				metronome.lastBeatTime = nextBeatTime;
 				size_t i = 0;
 				while (i < beatSize) {
-					mixedBlock[i % STEREO_BLOCK_SIZE] = beat[i];
+					beatBlock[i % STEREO_BLOCK_SIZE] = beat[i];
 					if (++i % STEREO_BLOCK_SIZE == 0) {
-						sbufferWrite(&leading.buffer, nextBeatTime++, mixedBlock, true);
+						sbufferWrite(&leading.buffer, nextBeatTime++, beatBlock, true);
 					}
 				}
 				if (i % STEREO_BLOCK_SIZE) {
 					for (; i % STEREO_BLOCK_SIZE; i++) {
-						mixedBlock[i % STEREO_BLOCK_SIZE] = 0;
+						beatBlock[i % STEREO_BLOCK_SIZE] = 0;
 					}
-					sbufferWrite(&leading.buffer, nextBeatTime++, mixedBlock, true);
+					sbufferWrite(&leading.buffer, nextBeatTime++, beatBlock, true);
 				}
 			}
+			histogramAdd(&mixerLatency[0][LATENCY_METRONOME], histogramNsec() - nsecMetronome);
 		}
+
+		if (backing.playing) {
+			uint64_t nsecBacking = histogramNsec();
+			leading.delay = leading.newDelay;
+			if (!backing.started) {
+				backing.nextTime = blockIndex + 1 + leading.delay;
+				sbufferClear(&leading.buffer, 0);
+				FOR_CLIENTS(client) {
+					client->leadingDelay = -1;
+				}
+				backing.started = true;
+			}
+			sample_t backingBlock[STEREO_BLOCK_SIZE];
+			while (backing.nextTime <= blockIndex + 1 + leading.delay) { // for the next tick, more after the delay increased
+				ssize_t pos = backingTrackRead(backing.track, backingBlock);
+				if (pos == -2) { // the end, rewound for playing again
+					backing.playing = false;
+					backing.started = false;
+					backingSeekBar(0);
+					break;
+				}
+				if (pos >= 0) { // otherwise not read ahead in time, left silent
+					sbufferWrite(&leading.buffer, backing.nextTime, backingBlock, false);
+					backing.pos = pos + 1;
+				}
+				backing.nextTime++;
+			}
+			histogramAdd(&mixerLatency[0][LATENCY_BACKING], histogramNsec() - nsecBacking);
+		} else if (backing.started) { // stopped, the blocks written ahead will be played again
+			size_t pos = backingPlayedPos();
+			backing.started = false;
+			backingTrackSeek(backing.track, pos);
+			backing.pos = pos;
+		} else if (backing.track) {
+			backingTrackSkipStale(backing.track); // so that the ring is filled before playing
+		}
+		histogramAdd(&mixerLatency[0][LATENCY_TICK], histogramNsec() - nsecTick);
 		blockIndex++;
 
 
 		// timing [
 
 		int64_t usec = getUsec(usecZero);
-		int64_t usecFree = getBlockUsec(blockIndex) - usec;
+		int64_t usecFree = getBlockUsec(blockIndex) + usecShift - usec;
 		usecFreeMin = (usecFreeMin > usecFree ? usecFree : usecFreeMin);
 		usecFreeSum += usecFree;
-		int64_t usecWakeDelay = usecAwaken - getBlockUsec(blockIndex - 1);
+		int64_t usecWakeDelay = usecAwaken - getBlockUsec(blockIndex - 1) - usecShift;
 		usecWakeDelayMax = (usecWakeDelayMax < usecWakeDelay ? usecWakeDelay : usecWakeDelayMax);
 		usecWakeDelaySum += usecWakeDelay;
+		histogramAdd(&mixerLatency[0][LATENCY_WAKE], usecWakeDelay * 1000);
 		int64_t usecLoad = usec - usecAwaken;
 		usecLoadMax = (usecLoadMax < usecLoad ? usecLoad : usecLoadMax);
 
 		FOR_CLIENTS(client) {
 			if (usec - client->lastPacketUsec > CONN_TIMEOUT_MSEC * 1000) {
 				client->connected = false;
-				client->connectedMain = false;
+				mainClientDisconnect(client);
 				msg("Client %d '%s' timeout, disconnected...", client->id, client->name);
 			}
 		}
@@ -897,7 +1934,8 @@ int main() {
 			msg("\n"
 					"  DELAY %6.0f us (%6.2f %%) avg,%6.0f us (%6.2f %%) max\n"
 					"  LOAD  %6.0f us (%6.2f %%) avg,%6.0f us (%6.2f %%) max\n"
-					"  FREE  %6.0f us (%6.2f %%) avg,%6.0f us (%6.2f %%) min\n",
+					"  FREE  %6.0f us (%6.2f %%) avg,%6.0f us (%6.2f %%) min\n"
+					"  LATE  %6zu ticks caught up, %6zu dropped\n",
 					(float)(usecWakeDelaySum) / BLOCKS_PER_SRV_STAT,
 					(float)(usecWakeDelaySum) / usecTot * 100,
 					(float)(usecWakeDelayMax),
@@ -909,35 +1947,49 @@ int main() {
 					(float)(usecFreeSum) / BLOCKS_PER_SRV_STAT,
 					(float)(usecFreeSum) / usecTot * 100,
 					(float)(usecFreeMin > 0 ? usecFreeMin : 0),
-					(float)(usecFreeMin > 0 ? usecFreeMin : 0) / usecBlock * 100);
+					(float)(usecFreeMin > 0 ? usecFreeMin : 0) / usecBlock * 100,
+					catchUpTicks, droppedTicks);
 
 			usecFreeSum = 0;
 			usecFreeMin = INT64_MAX;
 			usecWakeDelaySum = 0;
 			usecWakeDelayMax = 0;
 			usecLoadMax = 0;
+			catchUpTicks = 0;
+			droppedTicks = 0;
 		}
 
 		__sync_synchronize();
-		int64_t usecWait = getBlockUsec(blockIndex) - getUsec(usecZero);
-		if (usecWait < 0) {
-			msg("Sound mixer was late by %ld us...", -usecWait);
-		}
-		//while (usecWait > 0) {
+		int64_t usecWait = getBlockUsec(blockIndex) + usecShift - getUsec(usecZero);
 		if (usecWait > 0) {
-			if (schedPolicy == SP_DEADLINE) {
-				sched_yield();
-			} else {
-				usleep(usecWait);
-			}
-			//usecWait = getBlockUsec(blockIndex) - getUsec(usecZero);
+			sleepUntilUsec(getBlockUsec(blockIndex) + usecShift);
+			late = false;
+		} else if (usecWait < -getBlockUsec(SERVER_MAX_CATCHUP_BLOCKS)) {
+			// too late to catch up, the timeline is shifted instead, the next tick is now
+			size_t dropped = -usecWait * SAMPLE_RATE / MONO_BLOCK_SIZE / 1000000;
+			msg("Sound mixer was late by %ld us, %zu ticks dropped...", -usecWait, dropped);
+			usecShift -= usecWait;
+			droppedTicks += dropped;
+			mixerTickStats.dropped += dropped;
+			late = false;
+		} else {
+			// the missed tick is processed immediately
+			if (!late) msg("Sound mixer was late by %ld us, catching up...", -usecWait);
+			catchUpTicks++;
+			mixerTickStats.caughtUp++;
+			late = true;
 		}
 		usecAwaken = getUsec(usecZero);
 
 		// ] end of timing
 	}
 
-	pthread_join(udpThread, NULL);
+	for (int i = 0; i < SERVER_RECV_THREADS; i++) {
+		shutdown(udpSockets[i], SHUT_RDWR); // wakes up the remaining receivers
+	}
+	for (int i = 0; i < SERVER_RECV_THREADS; i++) {
+		pthread_join(udpThreads[i], NULL);
+	}
 	pthread_join(statusThread, NULL);
 	netCleanup();
 	msg("Exitting...");
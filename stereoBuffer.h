@@ -3,12 +3,47 @@
 #define audioBuffer stereoBuffer
 #define bufferFade sbufferFade
 #define bufferClear sbufferClear
+#define bufferPage sbufferPage
+#define bufferPool sbufferPool
+#define bufferPoolPage sbufferPoolPage
+#define bufferPoolPush sbufferPoolPush
+#define bufferPoolPop sbufferPoolPop
+#define bufferPoolGrow sbufferPoolGrow
+#define bufferPoolAlloc sbufferPoolAlloc
+#define bufferPoolFree sbufferPoolFree
+#define bufferPoolStats sbufferPoolStats
+#define bufferPageOf sbufferPageOf
+#define bufferReleaseBefore sbufferReleaseBefore
+#define bufferRelease sbufferRelease
+#define bufferInit sbufferInit
+#define bufferRecovered sbufferRecovered
+#define bufferWriteRecovered sbufferWriteRecovered
+#define bufferLossRate sbufferLossRate
+#define bufferPlcPeriod sbufferPlcPeriod
+#define bufferPlcGain sbufferPlcGain
+#define bufferPlcStart sbufferPlcStart
+#define bufferPlcNext sbufferPlcNext
+#define bufferPlcHistoryAdd sbufferPlcHistoryAdd
+#define bufferUsed sbufferUsed
+#define bufferUsedBits sbufferUsedBits
+#define bufferUnsetUsed sbufferUnsetUsed
+#define bufferFindUsedPair sbufferFindUsedPair
+#define bufferJitterShift sbufferJitterShift
+#define bufferCopyFrames sbufferCopyFrames
+#define bufferTsmLag sbufferTsmLag
+#define bufferTsmSplice sbufferTsmSplice
+#define bufferJitterUpdate sbufferJitterUpdate
+#define bufferJitterAdd sbufferJitterAdd
+#define bufferJitterOffset sbufferJitterOffset
+#define bufferJitterTarget sbufferJitterTarget
 #define bufferReadNext sbufferReadNext
 #define bufferRead sbufferRead
+#define bufferReadTo sbufferReadTo
 #define bufferWrite sbufferWrite
 #define bufferWriteNext sbufferWriteNext
 #define bufferOutputStats sbufferOutputStats
 #define bufferOutputStatsReset sbufferOutputStatsReset
+#define bufferSrvStats sbufferSrvStats
 #define bufferSrvStatsReset sbufferSrvStatsReset
 #define BLOCK_USED SBLOCK_USED
 #define BLOCK_EMPTY SBLOCK_EMPTY
@@ -19,14 +54,49 @@
 #undef audioBuffer
 #undef bufferFade
 #undef bufferClear
+#undef bufferPage
+#undef bufferPool
+#undef bufferPoolPage
+#undef bufferPoolPush
+#undef bufferPoolPop
+#undef bufferPoolGrow
+#undef bufferPoolAlloc
+#undef bufferPoolFree
+#undef bufferPoolStats
+#undef bufferPageOf
+#undef bufferReleaseBefore
+#undef bufferRelease
+#undef bufferInit
+#undef bufferRecovered
+#undef bufferWriteRecovered
+#undef bufferLossRate
+#undef bufferPlcPeriod
+#undef bufferPlcGain
+#undef bufferPlcStart
+#undef bufferPlcNext
+#undef bufferPlcHistoryAdd
+#undef bufferUsed
+#undef bufferUsedBits
+#undef bufferUnsetUsed
+#undef bufferFindUsedPair
+#undef bufferJitterShift
+#undef bufferCopyFrames
+#undef bufferTsmLag
+#undef bufferTsmSplice
+#undef bufferJitterUpdate
+#undef bufferJitterAdd
+#undef bufferJitterOffset
+#undef bufferJitterTarget
 #undef bufferReadNext
 #undef bufferRead
+#undef bufferReadTo
 #undef bufferWrite
 #undef bufferWriteNext
 #undef bufferOutputStats
 #undef bufferOutputStatsReset
 #undef BLOCK_USED
 #undef BLOCK_EMPTY
+#undef bufferSrvStats
 #undef bufferSrvStatsReset
 
 #undef BLOCK_SIZE
@@ -3,6 +3,7 @@
 
 #include <sched.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #ifdef SERVER_SCHED_DEADLINE
 #warning Defining sched_*attr, remove these lines if already defined
@@ -104,6 +105,20 @@ bool threadPriorityRealtime(uint32_t priority) {
 	}
 }
 
+// pins the calling thread to the given cpu, negative cpu means no pinning
+bool threadPinCpu(int cpu) {
+	if (cpu < 0) return true;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+		return true;
+	} else {
+		printf("Cannot pin thread to cpu %d.\n", cpu);
+		return false;
+	}
+}
+
 bool threadPriorityNice(uint32_t inc) {
 	errno = 0;
 	if ((nice(inc) != -1) || (errno == 0)) {
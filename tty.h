@@ -7,6 +7,7 @@
 #else
 #include <unistd.h>
 #include <termios.h>
+#include <sys/ioctl.h>
 #endif
 
 #ifdef __WIN32__
@@ -38,6 +39,19 @@ void ttyMoveUp(int lines) {
 #endif
 }
 
+// lines of the terminal, 0 if unknown
+int ttyHeight() {
+#ifdef __WIN32__
+	CONSOLE_SCREEN_BUFFER_INFO screenInfo;
+	if (!GetConsoleScreenBufferInfo(ttyStdoutHandle, &screenInfo)) return 0;
+	return screenInfo.srWindow.Bottom - screenInfo.srWindow.Top + 1;
+#else
+	struct winsize size;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0) return 0;
+	return size.ws_row;
+#endif
+}
+
 void ttyClearStatus();
 int ttyReadKey() {
 #ifdef __WIN32__
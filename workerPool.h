@@ -0,0 +1,119 @@
+// Virtual Choir Rehearsal Room  Copyright (C) 2021  Lukas Ondracek <ondracek.lukas@gmail.com>, use under GNU GPLv3
+
+/* needed defs:
+ *   WORKER_POOL_MAX_THREADS
+ */
+
+// Fork-join pool: workerPoolRun calls job(ctx, worker, workersCnt) for each worker < workersCnt
+// in parallel and returns after all of them finish; worker 0 is the calling thread itself.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef void workerJob(void *ctx, size_t worker, size_t workersCnt);
+
+struct workerPool {
+	pthread_mutex_t mutex;
+	pthread_cond_t startCond;
+	pthread_cond_t doneCond;
+	size_t threadsCnt;      // incl. the calling thread
+	size_t workersCnt;      // participating in current job
+	size_t pending;         // workers of current job not finished yet
+	unsigned generation;    // incremented with each job
+	workerJob *job;
+	void *ctx;
+	void (*threadInit)(void);
+	pthread_t threads[WORKER_POOL_MAX_THREADS];
+};
+
+struct workerPoolThreadArg {
+	struct workerPool *pool;
+	size_t worker;
+	unsigned generation; // before the thread was started, so that it cannot miss the following job
+};
+
+void *workerPoolThread(void *argPtr) {
+	struct workerPoolThreadArg arg = *(struct workerPoolThreadArg *)argPtr;
+	struct workerPool *pool = arg.pool;
+	free(argPtr);
+	if (pool->threadInit) pool->threadInit();
+
+	pthread_mutex_lock(&pool->mutex);
+	unsigned generation = arg.generation;
+	while (true) {
+		while (pool->generation == generation) {
+			pthread_cond_wait(&pool->startCond, &pool->mutex);
+		}
+		generation = pool->generation;
+		if (arg.worker >= pool->workersCnt) continue;
+		workerJob *job = pool->job;
+		void *ctx = pool->ctx;
+		size_t workersCnt = pool->workersCnt;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job(ctx, arg.worker, workersCnt);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->pending == 0) {
+			pthread_cond_signal(&pool->doneCond);
+		}
+	}
+	return NULL;
+}
+
+// returns number of threads actually available (at least 1)
+size_t workerPoolInit(struct workerPool *pool, size_t threadsCnt, void (*threadInit)(void)) {
+	if (threadsCnt > WORKER_POOL_MAX_THREADS) threadsCnt = WORKER_POOL_MAX_THREADS;
+	if (threadsCnt < 1) threadsCnt = 1;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->startCond, NULL);
+	pthread_cond_init(&pool->doneCond, NULL);
+	pool->generation = 0;
+	pool->workersCnt = 0;
+	pool->pending = 0;
+	pool->threadInit = threadInit;
+	pool->threadsCnt = 1;
+	for (size_t i = 1; i < threadsCnt; i++) {
+		struct workerPoolThreadArg *arg = malloc(sizeof(struct workerPoolThreadArg));
+		if (!arg) break;
+		arg->pool = pool;
+		arg->worker = i;
+		pthread_mutex_lock(&pool->mutex);
+		arg->generation = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+		if (pthread_create(&pool->threads[i], NULL, &workerPoolThread, arg) != 0) {
+			free(arg);
+			break;
+		}
+		pool->threadsCnt++;
+	}
+	return pool->threadsCnt;
+}
+
+// returns number of workers actually used
+size_t workerPoolRun(struct workerPool *pool, size_t workersCnt, workerJob *job, void *ctx) {
+	if (workersCnt > pool->threadsCnt) workersCnt = pool->threadsCnt;
+	if (workersCnt <= 1) {
+		job(ctx, 0, 1);
+		return 1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->job = job;
+	pool->ctx = ctx;
+	pool->workersCnt = workersCnt;
+	pool->pending = workersCnt - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->startCond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	job(ctx, 0, workersCnt);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->doneCond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return workersCnt;
+}